@@ -7,11 +7,13 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <sys/clonefile.h>
 
 #include "fail.h"
 #include "extents.h"
 #include "mem.h"
 #include "fiemap.h"
+#include "opts.h"
 
 void flags2str(unsigned flags, char *s, size_t n, bool sharing) { s[0]= '\0'; }
 
@@ -36,11 +38,18 @@ static void new_extent(fileinfo *pfi, off_t l, off_t p, off_t len) {
     new->p= p;
     new->len= len;
     new->flags= 0;
+    new->split= false;
 }
 
-void get_extents(fileinfo *pfi, off_t max_len) {
-    off_t limit= max_len > 0 ? pfi->skip + max_len : pfi->size;
-    off_t off= roundDown(pfi->skip, blk_sz);
+// map the extents overlapping [start, start+len) into pfi->exts (any previous array is the caller's to free).
+// Returns false if the number of extents changed while they were being read (which can't be detected here).
+bool get_extents(fileinfo *pfi, off_t start, off_t len) {
+    off_t limit= min(start + len, pfi->size);
+    off_t off= roundDown(start, blk_sz);
+    pfi->n_exts= 0;
+    pfi->exts= NULL;
+    if (sync_extents && fsync((int) pfi->fd) < 0)
+        fail("Can't sync %s : %s\n", pfi->name, strerror(errno));
     while (off < limit) {
         off_t contig;
         off_t ph= l2p(pfi->fd, off, limit - off, &contig);
@@ -50,11 +59,41 @@ void get_extents(fileinfo *pfi, off_t max_len) {
             off += contig;
         } else { // skip over hole
             off= lseek((int) pfi->fd, off, SEEK_DATA);
-            if (off < 0) fail("lseek failed: %d\n", strerror(errno));
+            if (off < 0) {
+                if (errno == ENXIO) break; // only a hole remains
+                fail("lseek failed: %s\n", strerror(errno));
+            }
         }
     }
+    return true;
 }
 
 bool flags_are_sane(unsigned flags) {
     return true; // no flags, no insanity
 }
+
+bool flags_are_settled(unsigned flags) {
+    return true;
+}
+
+bool reads_as_zeros(unsigned flags) {
+    return false; // holes are skipped, and unwritten extents can't be told apart
+}
+
+bool flags_are_shared(unsigned flags) {
+    return false; // can't be told
+}
+
+bool merge_flags(unsigned *f1, unsigned f2) {
+    return *f1 == f2;
+}
+
+// Create to as a clone of from, sharing all its blocks.  Returns false, and leaves no file to, if the filesystem can't.
+bool clone_file(char *from, char *to) {
+    return clonefile(from, to, 0) == 0;
+}
+
+bool punch_hole(int fd, off_t start, off_t len) {
+    struct fpunchhole ph= { 0, 0, start, len };
+    return fcntl(fd, F_PUNCHHOLE, &ph) == 0;
+}
@@ -5,15 +5,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <linux/fiemap.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 
 #include "fail.h"
 #include "extents.h"
 #include "mem.h"
 #include "fiemap.h"
+#include "opts.h"
 
 void flags2str(unsigned flags, char *s, size_t n, bool sharing) {
     // This list copied from <fiemap.h>
@@ -61,22 +66,69 @@ bool flags_are_sane(unsigned flags) {
 		      | FIEMAP_EXTENT_UNWRITTEN));
 }
 
-void get_extents(fileinfo *pfi, off_t max_len) {
-    off_t start= roundDown(pfi->skip, blk_sz);
-    off_t len= max_len > 0 ? max_len : pfi->size - pfi->skip;
-    struct fiemap fm= { (__u64)start, (__u64)len, 0L, 0L, 0 };
+// delayed allocation (or an unknown location) lasts only until the data are written out; other flags are for good
+bool flags_are_settled(unsigned flags) {
+    return 0 == (flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC));
+}
+
+// an extent allocated but not yet written (as by fallocate(2)), and otherwise sane, reads back as zeros
+bool reads_as_zeros(unsigned flags) {
+    return (flags & FIEMAP_EXTENT_UNWRITTEN) != 0 && flags_are_sane(flags & ~FIEMAP_EXTENT_UNWRITTEN);
+}
+
+// the filesystem knows of another extent (of any file, or of a snapshot) mapping the same physical blocks
+bool flags_are_shared(unsigned flags) {
+    return (flags & FIEMAP_EXTENT_SHARED) != 0;
+}
+
+// If the flags of two neighbouring extents agree (disregarding which is last and whether either was already merged),
+// set *f1 to the flags of the two combined and return true.
+bool merge_flags(unsigned *f1, unsigned f2) {
+    unsigned ignored= FIEMAP_EXTENT_LAST | FIEMAP_EXTENT_MERGED;
+    if ((*f1 & ~ignored) != (f2 & ~ignored)) return false;
+    *f1 |= f2;
+    return true;
+}
+
+// Create to as a clone of from, sharing all its extents.  Returns false, and leaves no file to, if the filesystem can't.
+bool clone_file(char *from, char *to) {
+    int src= open(from, O_RDONLY);
+    if (src < 0) fail("Can't open file %s : %s\n", from, strerror(errno));
+    int dst= open(to, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (dst < 0) fail("Can't create file %s : %s\n", to, strerror(errno));
+    bool ok= ioctl(dst, FICLONE, src) == 0;
+    close(src);
+    close(dst);
+    if (!ok) unlink(to);
+    return ok;
+}
+
+// Make [start, start+len) of fd a hole, leaving its size alone.  Returns false if the filesystem can't.  (fallocate()
+// itself is declared only with _GNU_SOURCE, which would clash with our splice().)
+bool punch_hole(int fd, off_t start, off_t len) {
+    return syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len) == 0;
+}
+
+// map the extents overlapping [start, start+len) into pfi->exts (any previous array is the caller's to free).
+// Returns false if the number of extents changed while they were being read.
+bool get_extents(fileinfo *pfi, off_t start, off_t len) {
+    off_t from= roundDown(start, blk_sz);
+    len += start - from;
+    start= from;
+    __u32 flags= sync_extents ? FIEMAP_FLAG_SYNC : 0;
+    struct fiemap fm= { (__u64)start, (__u64)len, flags, 0L, 0 };
     if (ioctl((int) pfi->fd, FS_IOC_FIEMAP, &fm) < 0)
         fail("Can't get extents : %s\n", strerror(errno));
     unsigned n= fm.fm_mapped_extents;
     struct fiemap *pfm= malloc_s(sizeof(struct fiemap) + n * sizeof(struct fiemap_extent));
     pfm->fm_start= (__u64)start;
     pfm->fm_length= (__u64)len;
-    pfm->fm_flags= (__u32)0;
+    pfm->fm_flags= flags;
     pfm->fm_extent_count= (__u32)n;
     if (ioctl((int)pfi->fd, FS_IOC_FIEMAP, pfm) < 0)
         fail("Can't get list of extents : %s\n", strerror(errno));
-    if (pfm->fm_mapped_extents != n)
-        fail("file is changing: %s; number of extents changed\n", pfi->name);
+    bool stable= pfm->fm_mapped_extents == n;
+    n= pfm->fm_mapped_extents;
     extent *pe= calloc_s(n, sizeof(extent));
     pfi->n_exts= n;
     pfi->exts=  pe;
@@ -90,5 +142,6 @@ void get_extents(fileinfo *pfi, off_t max_len) {
         ++pe; ++pfe;
     }
     free(pfm);
+    return stable;
 }
 
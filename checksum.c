@@ -0,0 +1,186 @@
+/*
+ * Clone-aware whole-file checksums (--checksum)
+ *
+ * Clones share most of their extents, so checksumming each file separately reads the shared data once per clone.
+ * Instead, the regions found by find_shares() (shared and unshared) are read in physical order, each exactly once,
+ * through one of the files which map it, and given a digest; each file's digest is then built from those of its
+ * regions, in logical order.  So the I/O goes with the unique physical bytes, not with the sum of the file sizes.
+ *
+ * For that the digest of a concatenation must follow from the digests of its parts, which a polynomial hash gives:
+ * over the bytes b_1 ... b_n, H = b_1 x^(n-1) + ... + b_n (mod 2^61-1), so H(AB) = H(A) x^|B| + H(B), and a hole of
+ * n zero bytes just multiplies by x^n.  A file's digest is therefore that of its contents (then its size), whatever
+ * its layout and whichever other files are given, and can be compared with one taken earlier or elsewhere.  Two bases
+ * make a 122-bit digest.  It detects corruption, not tampering: it is not a cryptographic hash.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "extents.h"
+#include "fail.h"
+#include "mem.h"
+#include "opts.h"
+#include "print.h"
+#include "sharing.h"
+
+#define BUF_SZ (1 << 20)
+
+#define P ((1ULL << 61) - 1)
+
+static const uint64_t base[2]= { 0x1C2F3A4B5D6E7F81ULL, 0x0B7E151628AED2A7ULL };
+
+static uint64_t reduce(uint64_t v) {
+    v= (v & P) + (v >> 61);
+    return v >= P ? v - P : v;
+}
+
+static uint64_t mul(uint64_t a, uint64_t b) {
+    unsigned __int128 v= (unsigned __int128) a * b;
+    return reduce((uint64_t) (v & P) + (uint64_t) (v >> 61));
+}
+
+static uint64_t power(uint64_t x, uint64_t n) {
+    uint64_t res= 1;
+    for (; n > 0; n >>= 1, x= mul(x, x))
+        if (n & 1) res= mul(res, x);
+    return res;
+}
+
+// d is followed by a part of len bytes with digest e (by n zero bytes if e is NULL)
+static void append_digest(digest *d, digest *e, off_t len) {
+    for (unsigned m= 0; m < 2; ++m)
+        d->h[m]= reduce(mul(d->h[m], power(base[m], (uint64_t) len)) + (e != NULL ? e->h[m] : 0));
+}
+
+// tab[m][j][b]: b x^j, so that 8 bytes can be added with one multiplication
+static uint64_t tab[2][8][256], x8[2];
+
+static void init_tables() {
+    for (unsigned m= 0; m < 2; ++m) {
+        uint64_t xj= 1;
+        for (unsigned j= 0; j < 8; ++j, xj= mul(xj, base[m]))
+            for (unsigned b= 0; b < 256; ++b)
+                tab[m][j][b]= mul(b, xj);
+        x8[m]= xj;
+    }
+}
+
+static void update(digest *d, unsigned char *p, size_t n) {
+    for (unsigned m= 0; m < 2; ++m) {
+        uint64_t h= d->h[m], (*t)[256]= tab[m];
+        size_t i= 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t s= t[7][p[i]] + t[6][p[i + 1]] + t[5][p[i + 2]] + t[4][p[i + 3]]
+                      + t[3][p[i + 4]] + t[2][p[i + 5]] + t[1][p[i + 6]] + t[0][p[i + 7]]; // < 8 * 2^61
+            h= reduce(mul(h, x8[m]) + reduce(s));
+        }
+        for (; i < n; ++i)
+            h= reduce(mul(h, base[m]) + p[i]);
+        d->h[m]= h;
+    }
+}
+
+static unsigned char *buf;
+
+// read s through the first file which maps it
+static void hash_region(sh_ext *s, digest *d) {
+    fileinfo *fi= &info[run_file(s, 0)];
+    off_t l= run_l(s, 0);
+    d->h[0]= d->h[1]= 0;
+    for (off_t done= 0, n; done < s->len; done += n) {
+        n= pread((int) fi->fd, buf, (size_t) min(s->len - done, BUF_SZ), l + done);
+        if (n <= 0) fail("Can't read %s : %s\n", fi->name, n < 0 ? strerror(errno) : "file has shrunk");
+        update(d, buf, (size_t) n);
+    }
+}
+
+static int region_cmp_phys(const void *pa, const void *pb) {
+    const sh_ext *a= *(sh_ext * const *) pa, *b= *(sh_ext * const *) pb;
+    return a->p > b->p ? 1 : a->p < b->p ? -1 : 0;
+}
+
+// where a file maps a region
+typedef struct piece piece;
+struct piece {
+    off_t l;
+    size_t region; // index in regions
+};
+
+static int piece_cmp(const void *pa, const void *pb) {
+    const piece *a= pa, *b= pb;
+    return a->l > b->l ? 1 : a->l < b->l ? -1 : 0;
+}
+
+void report_checksums() {
+    find_shares();
+    size_t n= n_elems(shared);
+    for (unsigned f= 0; f < nfiles; ++f)
+        n += n_elems(info[f].unsh);
+    sh_ext **regions= malloc_s(max(n, 1) * sizeof(sh_ext *));
+    n= 0;
+    ITER(shared, sh_ext*, s, { regions[n++]= s; })
+    for (unsigned f= 0; f < nfiles; ++f)
+        ITER(info[f].unsh, sh_ext*, s, { regions[n++]= s; })
+    qsort(regions, n, sizeof(sh_ext *), &region_cmp_phys);
+
+    init_tables();
+    buf= malloc_s(BUF_SZ);
+    digest *digests= malloc_s(max(n, 1) * sizeof(digest));
+    off_t bytes_read= 0;
+    for (size_t i= 0; i < n; ++i) {
+        hash_region(regions[i], &digests[i]);
+        bytes_read += regions[i]->len;
+    }
+    free(buf);
+
+    // the pieces of each file, in logical order
+    size_t *n_pieces= calloc_s(nfiles, sizeof(size_t));
+    for (size_t i= 0; i < n; ++i)
+        for (unsigned r= 0; r < n_runs(regions[i]); ++r)
+            n_pieces[run_file(regions[i], r)] += run_count(regions[i], r);
+    piece **pieces= malloc_s(nfiles * sizeof(piece *));
+    for (unsigned f= 0; f < nfiles; ++f) {
+        pieces[f]= malloc_s(max(n_pieces[f], 1) * sizeof(piece));
+        n_pieces[f]= 0;
+    }
+    for (size_t i= 0; i < n; ++i)
+        for (unsigned r= 0; r < n_runs(regions[i]); ++r) {
+            unsigned f= run_file(regions[i], r);
+            for (unsigned k= 0; k < run_count(regions[i], r); ++k)
+                pieces[f][n_pieces[f]++]= (piece) { run_l(regions[i], r) + k * run_stride(regions[i], r), i };
+        }
+
+    off_t total= 0;
+    for (unsigned f= 0; f < nfiles; ++f)
+        total += info[f].size;
+    print_checksums_header(bytes_read, total);
+    for (unsigned f= 0; f < nfiles; ++f) {
+        fileinfo *fi= &info[f];
+        close((int) fi->fd);
+        if (!fi->stable) { // left out
+            print_checksum(f, fi->size, NULL);
+            continue;
+        }
+        qsort(pieces[f], n_pieces[f], sizeof(piece), &piece_cmp);
+        digest d= { { 0, 0 } };
+        off_t at= 0;
+        for (size_t i= 0; i < n_pieces[f]; ++i) {
+            piece *pc= &pieces[f][i];
+            append_digest(&d, NULL, pc->l - at); // a hole reads as zeros
+            append_digest(&d, &digests[pc->region], regions[pc->region]->len);
+            at= pc->l + regions[pc->region]->len;
+        }
+        append_digest(&d, NULL, fi->size - at);
+        for (unsigned m= 0; m < 2; ++m) // so that files differing only in trailing zeros differ
+            d.h[m]= reduce(mul(d.h[m], base[m]) + reduce((uint64_t) fi->size));
+        print_checksum(f, fi->size, &d);
+        free(pieces[f]);
+    }
+    free(pieces);
+    free(n_pieces);
+    free(digests);
+    free(regions);
+}
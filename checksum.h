@@ -0,0 +1,15 @@
+// Whole-file checksums, reading each physical region once (--checksum)
+
+#ifndef EXTENTS_CHECKSUM_H
+#define EXTENTS_CHECKSUM_H
+
+#include <stdint.h>
+
+typedef struct digest digest;
+struct digest {
+    uint64_t h[2]; // a polynomial hash of the bytes modulo 2^61-1, for each of two bases
+};
+
+extern void report_checksums();
+
+#endif //EXTENTS_CHECKSUM_H
@@ -0,0 +1,179 @@
+/*
+ * Clone families (--clusters)
+ *
+ * While find_shares() sweeps, the bytes of each region are tallied against its interned set of owners and the region
+ * itself is dropped, so memory goes with the # of distinct sets of owners rather than with the # of regions.  The files
+ * of each set are then united in a union-find structure (union by size, with path halving), whose components are the
+ * families.  A family's total bytes are those of the regions its files map, each counted once, and its shared bytes
+ * those of the regions mapped more than once.
+ *
+ * With a threshold, the edges are listed too: each pair of files sharing at least that many bytes, with the bytes they
+ * share.  A set of k files adds to k(k-1)/2 edges, so this costs more when many files share the same regions.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "clusters.h"
+#include "extents.h"
+#include "mem.h"
+#include "opts.h"
+#include "owners.h"
+#include "print.h"
+
+static unsigned *parent, *size;
+
+static unsigned find(unsigned f) {
+    while (parent[f] != f) {
+        parent[f]= parent[parent[f]];
+        f= parent[f];
+    }
+    return f;
+}
+
+static void unite(unsigned a, unsigned b) {
+    a= find(a);
+    b= find(b);
+    if (a == b) return;
+    if (size[a] < size[b]) { unsigned t= a; a= b; b= t; }
+    parent[b]= a;
+    size[a] += size[b];
+}
+
+static void unite_owners(ownerset *s) {
+    for (unsigned r= 1; r < s->n; ++r)
+        unite(s->o[0].file, s->o[r].file);
+}
+
+static off_t *total_bytes, *shared_bytes; // of each component, at its root
+
+static void tally(ownerset *s) {
+    unsigned root= find(s->o[0].file);
+    total_bytes[root] += s->bytes;
+    if (s->n_owners > 1) shared_bytes[root] += s->bytes;
+}
+
+/*
+ * The edges: bytes shared by each pair of files, in a hash table keyed by the pair
+ */
+
+typedef struct edge edge;
+struct edge {
+    uint64_t key; // a << 32 | b, where a < b (so never 0); 0 if the slot is empty
+    off_t bytes;
+};
+
+static edge *edges;
+static size_t n_slots= 0, n_edges= 0;
+
+static size_t slot_of(edge *t, size_t n, uint64_t key) {
+    size_t i= (size_t) (key * 0x9E3779B97F4A7C15ULL) & (n - 1);
+    while (t[i].key != 0 && t[i].key != key)
+        i= (i + 1) & (n - 1);
+    return i;
+}
+
+static void add_edge(unsigned a, unsigned b, off_t bytes) {
+    if (2 * (n_edges + 1) > n_slots) {
+        size_t n= n_slots == 0 ? 1024 : 2 * n_slots;
+        edge *t= calloc_s(n, sizeof(edge));
+        for (size_t i= 0; i < n_slots; ++i)
+            if (edges[i].key != 0) t[slot_of(t, n, edges[i].key)]= edges[i];
+        free(edges);
+        edges= t;
+        n_slots= n;
+    }
+    uint64_t key= (uint64_t) a << 32 | b;
+    size_t i= slot_of(edges, n_slots, key);
+    if (edges[i].key == 0) {
+        edges[i].key= key;
+        n_edges++;
+    }
+    edges[i].bytes += bytes;
+}
+
+static void add_edges(ownerset *s) {
+    if (s->bytes == 0) return;
+    for (unsigned i= 0; i < s->n; ++i) {
+        if (i > 0 && s->o[i].file == s->o[i - 1].file) continue;
+        for (unsigned j= i + 1; j < s->n; ++j)
+            if (s->o[j].file != s->o[j - 1].file)
+                add_edge(s->o[i].file, s->o[j].file, s->bytes);
+    }
+}
+
+// most bytes first
+static int edge_cmp(const void *pa, const void *pb) {
+    const edge *a= pa, *b= pb;
+    return a->bytes < b->bytes ? 1
+         : a->bytes > b->bytes ? -1
+         : a->key > b->key ? 1
+         : a->key < b->key ? -1
+         : 0;
+}
+
+static unsigned *low; // the lowest member of each component, at its root
+
+// biggest first, then by lowest member
+static int root_cmp(const void *pa, const void *pb) {
+    unsigned a= *(const unsigned *) pa, b= *(const unsigned *) pb;
+    return total_bytes[a] < total_bytes[b] ? 1
+         : total_bytes[a] > total_bytes[b] ? -1
+         : low[a] > low[b] ? 1
+         : low[a] < low[b] ? -1
+         : 0;
+}
+
+void report_clusters() {
+    parent= calloc_s(nfiles, sizeof(unsigned));
+    size= calloc_s(nfiles, sizeof(unsigned));
+    total_bytes= calloc_s(nfiles, sizeof(off_t));
+    shared_bytes= calloc_s(nfiles, sizeof(off_t));
+    for (unsigned f= 0; f < nfiles; ++f) {
+        parent[f]= f;
+        size[f]= 1;
+    }
+    for_each_ownerset(&unite_owners);
+    for_each_ownerset(&tally);
+
+    // the members of each component, in order of file, after those of the components before it
+    unsigned *first= calloc_s(nfiles + 1, sizeof(unsigned)), *members= calloc_s(nfiles, sizeof(unsigned));
+    unsigned *roots= calloc_s(nfiles, sizeof(unsigned)), n_roots= 0;
+    low= calloc_s(nfiles, sizeof(unsigned));
+    for (unsigned f= nfiles; f-- > 0; )
+        low[find(f)]= f;
+    for (unsigned f= 0; f < nfiles; ++f)
+        if (find(f) == f) roots[n_roots++]= f;
+    qsort(roots, n_roots, sizeof(unsigned), &root_cmp);
+    unsigned *ix= calloc_s(nfiles, sizeof(unsigned)); // of each root in roots
+    for (unsigned i= 0; i < n_roots; ++i)
+        ix[roots[i]]= i;
+    for (unsigned f= 0; f < nfiles; ++f)
+        first[ix[find(f)] + 1]++;
+    for (unsigned i= 0; i < n_roots; ++i)
+        first[i + 1] += first[i];
+    unsigned *at= calloc_s(n_roots, sizeof(unsigned));
+    for (unsigned f= 0; f < nfiles; ++f) {
+        unsigned c= ix[find(f)];
+        members[first[c] + at[c]++]= f;
+    }
+
+    print_clusters_header();
+    for (unsigned i= 0; i < n_roots; ++i)
+        print_cluster(i + 1, &members[first[i]], first[i + 1] - first[i], total_bytes[roots[i]],
+                      shared_bytes[roots[i]]);
+
+    if (cluster_edges >= 0) {
+        for_each_ownerset(&add_edges);
+        size_t n= 0;
+        for (size_t i= 0; i < n_slots; ++i)
+            if (edges[i].key != 0 && edges[i].bytes >= cluster_edges) edges[n++]= edges[i];
+        qsort(edges, n, sizeof(edge), &edge_cmp);
+        print_edges_header();
+        for (size_t i= 0; i < n; ++i)
+            print_edge((unsigned) (edges[i].key >> 32), (unsigned) edges[i].key, edges[i].bytes);
+        free(edges);
+    }
+    free(at); free(ix); free(first); free(members); free(roots); free(low);
+    free(parent); free(size); free(total_bytes); free(shared_bytes);
+}
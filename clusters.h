@@ -0,0 +1,8 @@
+// Clone families: the files connected by sharing (--clusters)
+
+#ifndef EXTENTS_CLUSTERS_H
+#define EXTENTS_CLUSTERS_H
+
+extern void report_clusters();
+
+#endif //EXTENTS_CLUSTERS_H
@@ -4,6 +4,18 @@
  * Walks through a pair of files, one extent at a time (in logical order).  Reports regions which may differ;
  * suppresses the report when two regions share a physical extent.  Can be directed to start at any offset in either file
  * using -i, and to limit the size of the region being compared (-b).
+ *
+ * The files are mapped lazily, a window at a time, so that the first regions are reported (and ccmp can stop at the
+ * first difference) without first mapping the whole of both files.  Windows start small and grow geometrically.
+ *
+ * The regions go to an emitter: print_cmp() for -c, or the writer of a delta for --delta.
+ *
+ * Holes, and (with -S, once data in flight have been flushed) unwritten extents, read as zeros.  Where both files read
+ * as zeros nothing is reported; where only one does, the region is reported as such, so that only the other file need
+ * be read to check it.  Beyond the end of a file there is nothing to read, not zeros.
+ *
+ * The walk keeps what is left of each file's current extent in a cursor, leaving the maps alone, so with --all-pairs
+ * the files are mapped once, whole, and every pair is walked over the same maps.
  */
 
 #include <stdlib.h>
@@ -11,114 +23,209 @@
 
 #include "cmp.h"
 #include "extents.h"
+#include "fail.h"
+#include "fiemap.h"
 #include "lists.h"
 #include "opts.h"
 #include "print.h"
 
+#define WINDOW_MIN (1L << 20)
+#define WINDOW_MAX (1L << 30)
+
 typedef struct ecmp ecmp;
 struct ecmp {
-    list *lst; // list of extent*
-    extent *e;
+    fileinfo *fi;
+    extent e;      // what is left of the current extent (its logical offset relative to skip); the map is not changed
+    bool end;      // no extents left
+    unsigned i;    // index in fi->exts of the next extent
     off_t skip;
-    unsigned i;
+    region_kind zeros; // the kind of a region where this file reads as zeros
+    bool lazy;     // map a window at a time (else the whole map is already loaded)
+    off_t mapped;  // logical offset up to which the file has been mapped
+    off_t window;  // size of the next window to map
 } f1, f2;
 
 static void swap() { ecmp tmp= f1; f1= f2; f2= tmp; }
 
-static bool at_end(ecmp *ec) { return ec->e == NULL; }
+static bool at_end(ecmp *ec) { return ec->end; }
+
+// map the next non-empty window; parts of extents seen in earlier windows are trimmed off
+static bool next_window(ecmp *ec) {
+    fileinfo *fi= ec->fi;
+    off_t limit= ec->skip + max_cmp;
+    while (ec->mapped < limit) {
+        off_t len= min(ec->window, limit - ec->mapped);
+        free(fi->exts);
+        if (!map_extents(fi, ec->mapped, len))
+            fail("file is changing: %s\n", fi->name);
+        off_t end= ec->mapped + len;
+        if (fi->n_exts > 0) end= max(end, end_l(&fi->exts[fi->n_exts - 1]));
+        trim_extents(fi, ec->mapped, min(limit, fi->size));
+        ec->mapped= end;
+        ec->window= min(2 * ec->window, WINDOW_MAX);
+        ec->i= 0;
+        if (fi->n_exts > 0) return true;
+    }
+    return false;
+}
 
 static bool advance(ecmp *ec) {
-    if (ec->i < n_elems(ec->lst)) {
-        extent *e= get(ec->lst, ec->i++);
-        ec->e= e;
-        off_t max_off= ec->skip + max_cmp;
-        off_t l= e->l;
-        if (l >= max_off)
-            ec->e= NULL;
-        else {
-            if (l + e->len > max_off)
-                e->len= max_off - l;
-            e->l -= ec->skip;
-        }
-    } else
-        ec->e= NULL;
-    return ec->e != NULL;
+    if (ec->i == ec->fi->n_exts && (!ec->lazy || !next_window(ec)))
+        ec->end= true;
+    else {
+        ec->e= ec->fi->exts[ec->i++];
+        ec->e.l -= ec->skip;
+    }
+    return !ec->end;
+}
+
+// move the start of the current extent on by len
+static void consume(ecmp *ec, off_t len) {
+    ec->e.l += len;
+    ec->e.p += len;
+    ec->e.len -= len;
 }
 
-static void init(ecmp *ec, fileinfo *info) {
-    ec->lst= new_list((int)info->n_exts);
-    for (unsigned i= 0; i < info->n_exts; ++i)
-        append(ec->lst, &info->exts[i]);
+// start a walk of the file, the nth of the pair; if lazy, its extents are mapped as the walk goes
+static void init(ecmp *ec, fileinfo *info, unsigned n, bool lazy) {
+    ec->fi= info;
+    ec->zeros= n == 1 ? ZERO_1 : ZERO_2;
+    ec->lazy= lazy;
+    if (lazy) {
+        ec->fi->n_exts= 0;
+        ec->fi->exts= NULL;
+    }
+    ec->end= false;
     ec->skip= info->skip;
+    ec->mapped= info->skip;
+    ec->window= WINDOW_MIN;
     ec->i= 0;
-    while (advance(ec) && end_l(ec->e) <= 0)
-        ;
-    off_t l;
-    if (!at_end(ec) && (l= ec->e->l, l < 0)) { // trim off before skip
-        ec->e->l= 0;
-        ec->e->len += l;
-        ec->e->p -= l;
-    }
+    advance(ec);
 }
 
-static off_t last_start= -1, last_len; // used to merge contiguous regions
+// An extent whose flags say its physical address is not (yet) meaningful can't be trusted to be shared.
+static bool same_phys(extent *a, extent *b) {
+    return a->p == b->p && flags_are_sane(a->flags) && flags_are_sane(b->flags);
+}
+
+// the current extent of ec reads as zeros (trusted only with -S, as data in flight may not yet have been written)
+static bool zero_ext(ecmp *ec) { return sync_extents && reads_as_zeros(ec->e.flags); }
+
+static off_t last_start= -1, last_len; // used to merge contiguous regions of the same kind
+static region_kind last_kind;
+
+static region_fn *emit;
 
 static void print_last() {
-    if (last_start >= 0) print_cmp(last_start, last_len);
+    if (last_start >= 0) emit(last_start, last_len, last_kind);
+}
+
+// the walk has passed a shared region, so the last region can grow no further
+static void flush_last() {
+    print_last();
+    last_start= -1;
 }
 
-static void report(off_t len) {
-    off_t start1= f1.e->l;
-    if (last_start >= 0 && last_start + last_len == start1)
+static void report(off_t start, off_t len, region_kind kind) {
+    if (last_start >= 0 && last_start + last_len == start && last_kind == kind)
         last_len += len;
     else {
         print_last();
-        last_start= start1;
+        last_start= start;
         last_len= len;
+        last_kind= kind;
     }
 }
 
-// trunc at max_cmp
-void generate_cmp_output() {
-    check_all_extents_are_sane();
-    if (max_cmp < 0) {
-        off_t size1= info[0].size - info[0].skip,
-                size2= info[1].size - info[1].skip;
-        max_cmp= size1 > size2 ? size1 : size2;
+// the next len bytes of the current extent of x, where the other file, y, has a hole or has ended
+static void report_alone(ecmp *x, ecmp *y, off_t len) {
+    off_t start= x->e.l, eof= y->fi->size - y->skip;
+    off_t in_y= max(min(len, eof - start), 0); // the part before the end of y, which reads as zeros there
+    if (in_y > 0) {
+        if (zero_ext(x)) flush_last();
+        else report(start, in_y, y->zeros);
     }
-    init(&f1, &info[0]);
-    init(&f2, &info[1]);
+    if (len > in_y) report(start + in_y, len - in_y, MAY_DIFFER);
+}
+
+// the next len bytes of the current extents of f1 and f2, which start at the same offset
+static void report_both(off_t len) {
+    bool z1= zero_ext(&f1), z2= zero_ext(&f2);
+    if ((z1 && z2) || (!z1 && !z2 && same_phys(&f1.e, &f2.e))) flush_last();
+    else if (z1 || z2) report(f1.e.l, len, z1 ? f1.zeros : f2.zeros);
+    else report(f1.e.l, len, MAY_DIFFER);
+}
+
+// walk f1 and f2 from their starts, emitting the regions which may differ
+static void walk() {
+    last_start= -1;
     while (!at_end(&f1) && !at_end(&f2)) {
-        if (f1.e->l > f2.e->l) swap();
-        if (end_l(f1.e) <= f2.e->l) {
-            report(f1.e->len);
+        if (f1.e.l > f2.e.l) swap();
+        if (end_l(&f1.e) <= f2.e.l) {
+            report_alone(&f1, &f2, f1.e.len);
             if (!advance(&f1)) break;
-        } else if (f1.e->l < f2.e->l) {
-            off_t head= f2.e->l - f1.e->l;
-            report(head);
-            f1.e->l= f2.e->l;
-            f1.e->p += head;
-            f1.e->len -= head;
+        } else if (f1.e.l < f2.e.l) {
+            off_t head= f2.e.l - f1.e.l;
+            report_alone(&f1, &f2, head);
+            consume(&f1, head);
         } else { // same start
-            if (f1.e->len > f2.e->len) swap();
-            if (f1.e->len < f2.e->len) {
-                if (f1.e->p != f2.e->p) report(f1.e->len);
-                f2.e->l= end_l(f1.e);
-                f2.e->p += f1.e->len;
-                f2.e->len -= f1.e->len;
+            if (f1.e.len > f2.e.len) swap();
+            if (f1.e.len < f2.e.len) {
+                report_both(f1.e.len);
+                consume(&f2, f1.e.len);
                 if (!advance(&f1)) break;
             } else { // same start and len
-                if (f1.e->p != f2.e->p) report(f1.e->len);
+                report_both(f1.e.len);
                 advance(&f1);
                 advance(&f2);
                 if (at_end(&f1) || at_end(&f2)) break;
             }
         }
     }
-    if (at_end(&f1)) f1= f2;
+    if (at_end(&f1)) swap();
     while (!at_end(&f1)) {
-        report(f1.e->len);
+        report_alone(&f1, &f2, f1.e.len);
         advance(&f1);
     }
     print_last();
-}
\ No newline at end of file
+}
+
+// trunc at max_cmp
+void walk_unshared(region_fn *fn) {
+    emit= fn;
+    if (max_cmp < 0) {
+        off_t size1= info[0].size - info[0].skip,
+                size2= info[1].size - info[1].skip;
+        max_cmp= size1 > size2 ? size1 : size2;
+    }
+    init(&f1, &info[0], 1, true);
+    init(&f2, &info[1], 2, true);
+    walk();
+}
+
+void generate_cmp_output() { walk_unshared(&print_cmp); }
+
+static unsigned pair_a, pair_b; // the files being compared by --all-pairs
+
+static void print_pair_region(off_t start, off_t len, region_kind kind) {
+    print_pair_cmp(pair_a, pair_b, start, len, kind);
+}
+
+// the regions which may differ between each pair of the (already mapped) files; nothing is known of where a file left
+// out (with -S, as never settling) has data, so all of a pair including it may differ
+void generate_all_pairs_output() {
+    if (!no_headers) print_file_key();
+    emit= &print_pair_region;
+    for (pair_a= 0; pair_a < nfiles; ++pair_a)
+        for (pair_b= pair_a + 1; pair_b < nfiles; ++pair_b) {
+            if (!no_headers) print_pair_header(pair_a, pair_b);
+            if (!info[pair_a].stable || !info[pair_b].stable) {
+                off_t len= max(info[pair_a].size, info[pair_b].size);
+                if (len > 0) print_pair_region(0, len, MAY_DIFFER);
+                continue;
+            }
+            init(&f1, &info[pair_a], 1, false);
+            init(&f2, &info[pair_b], 2, false);
+            walk();
+        }
+}
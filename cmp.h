@@ -5,6 +5,17 @@
 #ifndef EXTENTS_CMP_H
 #define EXTENTS_CMP_H
 
+#include <sys/types.h>
+
+// what is known of a region which may differ: ZERO_n if file n is known to read as zeros there (it has a hole or, with
+// -S, an unwritten extent), so only the other file need be read
+typedef enum { MAY_DIFFER, ZERO_1, ZERO_2 } region_kind;
+
+// receives each region (logical offset, relative to the skips, and length) which may differ
+typedef void region_fn(off_t start, off_t len, region_kind kind);
+
+extern void walk_unshared(region_fn *fn);
 extern void generate_cmp_output();
+extern void generate_all_pairs_output();
 
 #endif //EXTENTS_CMP_H
@@ -0,0 +1,66 @@
+/*
+ * Coalescing (--coalesce)
+ *
+ * FIEMAP often reports a large extent as a run of pieces which are contiguous both physically and logically, and
+ * splitting in find_shares() turns each into a chain of regions with the same owners.  Merging such neighbours, in the
+ * raw extents of each file as they are mapped and in the regions found by the sweep, cuts the memory, sorting and
+ * output they would cost.  Neighbours are merged only if their flags agree (as judged by merge_flags()).
+ */
+
+#include <stdlib.h>
+
+#include "coalesce.h"
+#include "fiemap.h"
+#include "sharing.h"
+
+unsigned long exts_before= 0, exts_after= 0, regions_before= 0, regions_after= 0;
+
+// the extents of a file are in logical order
+void coalesce_extents(fileinfo *fi) {
+    unsigned n= 0;
+    for (unsigned i= 0; i < fi->n_exts; ++i) {
+        extent *e= &fi->exts[i], *prev= n > 0 ? &fi->exts[n - 1] : NULL;
+        if (prev != NULL && end_l(prev) == e->l && prev->p + prev->len == e->p && merge_flags(&prev->flags, e->flags))
+            prev->len += e->len;
+        else
+            fi->exts[n++]= *e;
+    }
+    exts_before += fi->n_exts;
+    exts_after += n;
+    fi->n_exts= n;
+}
+
+// Regions with the same owners have the same (interned) owner set, and are contiguous logically for every owner if
+// their deltas are the same.
+static bool can_merge(sh_ext *a, sh_ext *b) {
+    if (a->p + a->len != b->p || a->owners != b->owners) return false;
+    for (unsigned i= 0; i < n_runs(a) + a->owners->n_strided; ++i)
+        if (a->delta[i] != b->delta[i]) return false;
+    return true;
+}
+
+// l is a list of sh_ext*, in physical order
+void coalesce_regions(list *l) {
+    size_t n= 0;
+    ITER(l, sh_ext*, s, {
+        sh_ext *prev= n > 0 ? get(l, n - 1) : NULL;
+        if (prev != NULL && can_merge(prev, s)) {
+            prev->len += s->len;
+            free(s);
+        } else
+            put(l, n++, s);
+    })
+    regions_before += n_elems(l);
+    regions_after += n;
+    l->nelems= n;
+}
+
+// coalesce the results of find_shares()
+void coalesce_shares() {
+    coalesce_regions(shared);
+    for (unsigned i= 0; i < nfiles; ++i) {
+        size_t n= n_elems(info[i].unsh);
+        coalesce_regions(info[i].unsh);
+        total_unshared -= n - n_elems(info[i].unsh);
+    }
+}
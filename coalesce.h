@@ -0,0 +1,16 @@
+// Merging neighbouring extents and regions which are contiguous both physically and logically (--coalesce)
+
+#ifndef EXTENTS_COALESCE_H
+#define EXTENTS_COALESCE_H
+
+#include "extents.h"
+#include "lists.h"
+
+// counts before and after coalescing
+extern unsigned long exts_before, exts_after, regions_before, regions_after;
+
+extern void coalesce_extents(fileinfo *fi);
+extern void coalesce_regions(list *l);
+extern void coalesce_shares();
+
+#endif //EXTENTS_COALESCE_H
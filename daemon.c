@@ -0,0 +1,422 @@
+/*
+ * Resident daemon (--daemon SOCKET)
+ *
+ * Keeps the sharing map in memory and answers --query queries from clients of a Unix socket, one query per line.
+ * The input files are watched with inotify; when one changes it alone is remapped, and sharing is redetermined only
+ * over the parts of the device it touches (before or after the change):
+ *
+ * The pristine extents of all files are kept in physical order.  The changed file's old extents are removed from this
+ * index and its new ones merged in, rewriting the index only from the lowest physical offset of either.  Each of its
+ * old and new physical ranges is then widened to take in every extent overlapping it, repeatedly, until no extent
+ * crosses either end; since regions never extend across such a point, the shared and unshared regions found by sweeping
+ * just the extents inside are exactly those a full find_shares() would find there.  They replace the old regions in
+ * that range, and their pieces replace the old ones in the query index of each file they belong to.
+ *
+ * shared and the unsh lists are kept in physical order here.
+ */
+
+#ifdef linux
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+#include "extents.h"
+#include "fail.h"
+#include "lists.h"
+#include "mem.h"
+#include "opts.h"
+#include "phys.h"
+#include "query.h"
+#include "sharing.h"
+#include "sorting.h"
+
+#define SETTLE_MS 200   // wait this long after the last change to a file before remapping it
+#define MAX_STALE_MS 2000 // but no longer than this after the first, if changes keep coming
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+static list *pindex;    // pristine extent*s of all files (from their exts arrays), in physical order
+static phys_index *pi;
+
+static int *wd;         // inotify watch of each file, or -1
+static bool *dirty;     // file has changed since last mapped
+static struct timespec settle_at; // when the dirty files are to be remapped
+static struct timespec stale_at;  // the latest settle_at may be put off to
+static bool any_dirty= false;
+
+static volatile sig_atomic_t stopping= false;
+
+static int phys_cmp(const void *a, const void *b) { return extent_list_cmp_phys((extent **) a, (extent **) b); }
+
+static void sort_phys(list *l) {
+    if (!is_empty(l)) qsort(&GET(l, 0), n_elems(l), sizeof(extent *), &phys_cmp);
+}
+
+// index of the first element of l (sorted by physical offset) at or after p; l holds extent*s or sh_ext*s
+#define FIRST_AT(l, T, off) ({                                \
+  list *_l= (l); size_t _lo= 0, _hi= n_elems(_l);            \
+  while (_lo < _hi) {                                         \
+    size_t _mid= _lo + (_hi - _lo) / 2;                       \
+    if (((T) get(_l, _mid))->p >= (off)) _hi= _mid;           \
+    else _lo= _mid + 1;                                       \
+  }                                                           \
+  _lo; })
+
+// redetermine sharing within [from, to), which no extent crosses, appending the regions replaced to gone and their
+// replacements to added
+static void resweep(off_t from, off_t to, list *gone, list *added) {
+    size_t i= FIRST_AT(shared, sh_ext*, from), j= FIRST_AT(shared, sh_ext*, to);
+    for (size_t k= i; k < j; ++k)
+        append(gone, get(shared, k));
+    size_t *n_unsh= calloc_s(nfiles, sizeof(size_t));
+    for (unsigned f= 0; f < nfiles; ++f) {
+        list *unsh= info[f].unsh;
+        size_t a= FIRST_AT(unsh, sh_ext*, from), b= FIRST_AT(unsh, sh_ext*, to);
+        for (size_t k= a; k < b; ++k)
+            append(gone, get(unsh, k));
+        total_unshared -= b - a;
+        list *none= new_list(-1);
+        splice(unsh, a, b, none);
+        free_list(none);
+        n_unsh[f]= n_elems(unsh);
+    }
+
+    // the sweep trims extents in place, so works on copies
+    size_t first= FIRST_AT(pindex, extent*, from), n= FIRST_AT(pindex, extent*, to) - first;
+    extent *copies= calloc_s(n, sizeof(extent));
+    list *work= new_list(-(ssize_t)(n + 1));
+    for (size_t k= 0; k < n; ++k) {
+        copies[k]= *(extent *) get(pindex, first + k);
+        append(work, &copies[k]);
+    }
+    list *all_shared= shared;
+    shared= new_list(-4);
+    sweep_extents(work);
+    ITER(shared, sh_ext*, s, append(added, s))
+    splice(all_shared, i, j, shared);
+    free_list(shared);
+    shared= all_shared;
+
+    // the unsh regions just appended go back where the old ones were
+    for (unsigned f= 0; f < nfiles; ++f) {
+        list *unsh= info[f].unsh;
+        if (n_elems(unsh) == n_unsh[f]) continue;
+        list *back= new_list(-(ssize_t)(n_elems(unsh) - n_unsh[f]));
+        for (size_t k= n_unsh[f]; k < n_elems(unsh); ++k) {
+            append(back, get(unsh, k));
+            append(added, get(unsh, k));
+        }
+        unsh->nelems= n_unsh[f];
+        splice(unsh, FIRST_AT(unsh, sh_ext*, from), FIRST_AT(unsh, sh_ext*, from), back);
+        free_list(back);
+    }
+    free(copies);
+    free_list(work);
+    free(n_unsh);
+}
+
+// widen [*from, *to) until no extent crosses either end
+static void widen(off_t *from, off_t *to) {
+    for (bool grown= true; grown; ) {
+        grown= false;
+        ITER_OVERLAPPING(pi, *from, *to - *from, e, {
+            if (e->p < *from) { *from= e->p; grown= true; }
+            if (e->p + e->len > *to) { *to= e->p + e->len; grown= true; }
+        })
+    }
+}
+
+typedef struct span span;
+struct span { off_t from, to; };
+
+static int span_cmp(const void *a, const void *b) {
+    off_t fa= ((span *) a)->from, fb= ((span *) b)->from;
+    return fa > fb ? 1 : fa < fb ? -1 : 0;
+}
+
+// Resweep the neighbourhoods of the n physical spans in ss.  The query index is patched once all are done: until
+// then, the pieces of the changed file, old and new, can overlap.
+static void resweep_spans(span *ss, unsigned n) {
+    for (unsigned k= 0; k < n; ++k)
+        widen(&ss[k].from, &ss[k].to);
+    qsort(ss, n, sizeof(span), &span_cmp);
+    list *gone= new_list(-4), *added= new_list(-4);
+    for (unsigned k= 0; k < n; ) {
+        off_t from= ss[k].from, to= ss[k].to;
+        for (++k; k < n && ss[k].from <= to; ++k)
+            to= max(to, ss[k].to);
+        resweep(from, to, gone, added);
+    }
+    update_query_index(gone, added);
+    ITER(gone, sh_ext*, s, free(s))
+    free_list(gone);
+    free_list(added);
+}
+
+// map the file afresh; one which can't be opened (or is no longer a regular file, or can't be mapped) now has no
+// extents, and the daemon carries on without it
+static void remap(fileinfo *fi) {
+    fi->n_exts= 0;
+    fi->exts= NULL;
+    int fd= open(fi->name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", fi->name, strerror(errno));
+        return;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || (sb.st_mode & S_IFMT) != S_IFREG || sb.st_blksize != blk_sz) {
+        fprintf(stderr, "%s: no longer a regular file with the same block size\n", fi->name);
+        close(fd);
+        return;
+    }
+    fi->fd= (unsigned) fd;
+    fi->size= sb.st_size;
+    jmp_buf failed; // FIEMAP failing on one file mustn't take the daemon down
+    volatile bool mapped= false, caught= true;
+    fail_catch= &failed;
+    if (setjmp(failed) == 0) {
+        mapped= map_extents(fi, 0, fi->size);
+        caught= false;
+    }
+    fail_catch= NULL;
+    if (mapped)
+        trim_extents(fi, 0, fi->size);
+    else {
+        if (caught)
+            fprintf(stderr, "%s: can't be mapped; left out\n", fi->name);
+        else
+            fprintf(stderr, "%s: extents unstable after %d attempts; left out\n", fi->name, fi->attempts);
+        free(fi->exts);
+        fi->exts= NULL;
+        fi->n_exts= 0;
+        fi->stable= false;
+    }
+    close(fd);
+}
+
+// In the index, replace the n_old extents old of fi with news (sorted).  Only the part of the index from the lowest
+// physical offset among them on is rewritten.
+static void replace_extents(fileinfo *fi, extent *old, unsigned n_old, list *news) {
+    if (n_old == 0 && is_empty(news)) return;
+    off_t from= is_empty(news) ? old[0].p : ((extent *) first(news))->p;
+    for (unsigned k= 0; k < n_old; ++k)
+        from= min(from, old[k].p);
+    size_t lo= FIRST_AT(pindex, extent*, from), k= 0;
+    list *tail= new_list(-(ssize_t)(n_elems(pindex) - lo + n_elems(news) + 1));
+    for (size_t i= lo; i < n_elems(pindex); ++i) {
+        extent *e= get(pindex, i);
+        if (e->info == fi) continue; // one of old
+        while (k < n_elems(news) && extent_list_cmp_phys((extent **) &GET(news, k), &e) < 0)
+            append(tail, get(news, k++));
+        append(tail, e);
+    }
+    while (k < n_elems(news))
+        append(tail, get(news, k++));
+    splice(pindex, lo, n_elems(pindex), tail);
+    free_list(tail);
+    update_reach(pi, lo);
+}
+
+static void update(unsigned f) {
+    fileinfo *fi= &info[f];
+    extent *old= fi->exts;
+    unsigned n_old= fi->n_exts;
+    remap(fi);
+
+    list *news= new_list(-(ssize_t)(fi->n_exts + 1));
+    for (unsigned k= 0; k < fi->n_exts; ++k)
+        append(news, &fi->exts[k]);
+    sort_phys(news);
+    replace_extents(fi, old, n_old, news);
+    free_list(news);
+
+    unsigned n= n_old + fi->n_exts;
+    span *ss= calloc_s(n, sizeof(span));
+    for (unsigned i= 0; i < n_old; ++i)
+        ss[i]= (span) { old[i].p, old[i].p + old[i].len };
+    for (unsigned i= 0; i < fi->n_exts; ++i)
+        ss[n_old + i]= (span) { fi->exts[i].p, fi->exts[i].p + fi->exts[i].len };
+    if (n > 0) resweep_spans(ss, n);
+    free(ss);
+    free(old);
+}
+
+static int ms_until(struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms= (t->tv_sec - now.tv_sec) * 1000 + (t->tv_nsec - now.tv_nsec) / 1000000;
+    return ms < 0 ? 0 : (int) ms;
+}
+
+// t is ms from now, but no later than limit (if any)
+static void set_after(struct timespec *t, long ms, struct timespec *limit) {
+    clock_gettime(CLOCK_MONOTONIC, t);
+    t->tv_nsec += ms * 1000000L;
+    t->tv_sec += t->tv_nsec / 1000000000L;
+    t->tv_nsec %= 1000000000L;
+    if (limit != NULL && (t->tv_sec > limit->tv_sec || (t->tv_sec == limit->tv_sec && t->tv_nsec > limit->tv_nsec)))
+        *t= *limit;
+}
+
+static void watch(int ifd, unsigned f) {
+    wd[f]= inotify_add_watch(ifd, info[f].name, WATCH_EVENTS);
+    if (wd[f] < 0)
+        fprintf(stderr, "Can't watch %s : %s\n", info[f].name, strerror(errno));
+}
+
+static void read_events(int ifd) {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t n= read(ifd, buf, sizeof(buf));
+    for (char *p= buf; n > 0 && p < buf + n; ) {
+        struct inotify_event *ev= (struct inotify_event *) p;
+        for (unsigned f= 0; f < nfiles; ++f)
+            if (wd[f] == ev->wd) {
+                dirty[f]= true;
+                if (ev->mask & IN_IGNORED) wd[f]= -1; // file was deleted or replaced; rewatch when settled
+            }
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+    if (!any_dirty) set_after(&stale_at, MAX_STALE_MS, NULL);
+    any_dirty= true;
+    set_after(&settle_at, SETTLE_MS, &stale_at);
+}
+
+static void update_dirty(int ifd) {
+    for (unsigned f= 0; f < nfiles; ++f)
+        if (dirty[f]) {
+            dirty[f]= false;
+            if (wd[f] < 0) watch(ifd, f);
+            update(f);
+        }
+    any_dirty= false;
+}
+
+typedef struct client client;
+struct client {
+    int fd;
+    FILE *out;
+    char *buf;   // partial query line
+    size_t used, sz;
+};
+
+static bool serve(client *c) {
+    if (c->sz - c->used < 1024) {
+        c->sz= c->sz * 2 + 1024;
+        c->buf= realloc_s(c->buf, c->sz);
+    }
+    ssize_t n= read(c->fd, c->buf + c->used, c->sz - c->used - 1);
+    if (n <= 0) return false;
+    c->used += n;
+    c->buf[c->used]= '\0';
+    char *line= c->buf, *nl;
+    while ((nl= strchr(line, '\n')) != NULL) {
+        *nl= '\0';
+        answer_query(line, c->out);
+        line= nl + 1;
+    }
+    fflush(c->out);
+    c->used -= line - c->buf;
+    memmove(c->buf, line, c->used);
+    return true;
+}
+
+static void drop(client *c) {
+    fclose(c->out);
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+static void stop(int sig) { stopping= true; }
+
+static int listen_on(char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) fail("Socket path too long: %s\n", path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family= AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int sfd= socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sfd < 0) fail("Can't create socket : %s\n", strerror(errno));
+    unlink(path);
+    if (bind(sfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sfd, 16) < 0)
+        fail("Can't listen on %s : %s\n", path, strerror(errno));
+    return sfd;
+}
+
+void run_daemon() {
+    list *all= new_list(-(ssize_t)(n_ext + 1));
+    ITER(extents, extent*, e, append(all, e))
+    sort_phys(all);
+    pindex= all;
+    pi= new_phys_index(pindex);
+    shared= new_list(-10); // SWAG
+    build_query_index(); // empty, until the first sweep fills it
+    if (!is_empty(pindex)) resweep_spans(&(span) { 0, pi->reach[n_elems(pindex) - 1] }, 1);
+
+    int ifd= inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd < 0) fail("Can't initialize inotify : %s\n", strerror(errno));
+    wd= calloc_s(nfiles, sizeof(int));
+    dirty= calloc_s(nfiles, sizeof(bool));
+    for (unsigned f= 0; f < nfiles; ++f)
+        watch(ifd, f);
+    int sfd= listen_on(daemon_socket);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    list *clients= new_list(-4);
+    while (!stopping) {
+        unsigned nc= n_elems(clients);
+        struct pollfd *pfds= calloc_s(nc + 2, sizeof(struct pollfd));
+        pfds[0]= (struct pollfd) { sfd, POLLIN, 0 };
+        pfds[1]= (struct pollfd) { ifd, POLLIN, 0 };
+        for (unsigned k= 0; k < nc; ++k)
+            pfds[k + 2]= (struct pollfd) { ((client *) get(clients, k))->fd, POLLIN, 0 };
+        int n= poll(pfds, nc + 2, any_dirty ? ms_until(&settle_at) : -1);
+        if (n < 0 && errno != EINTR) fail("poll failed : %s\n", strerror(errno));
+        if (n > 0 && pfds[1].revents & POLLIN) read_events(ifd);
+        // whatever woke the poll, so that a stream of queries or of changes can't hold the update off
+        if (any_dirty && ms_until(&settle_at) == 0) update_dirty(ifd);
+        if (n > 0) {
+            list *live= new_list(-4);
+            for (unsigned k= 0; k < nc; ++k) {
+                client *c= get(clients, k);
+                if (pfds[k + 2].revents == 0 || serve(c)) append(live, c);
+                else drop(c);
+            }
+            free_list(clients);
+            clients= live;
+            if (pfds[0].revents & POLLIN) {
+                int cfd= accept(sfd, NULL, NULL);
+                if (cfd >= 0) {
+                    client *c= calloc_s(1, sizeof(client));
+                    c->fd= cfd;
+                    c->out= fdopen(dup(cfd), "w");
+                    append(clients, c);
+                }
+            }
+        }
+        free(pfds);
+    }
+    unlink(daemon_socket);
+}
+
+#else
+
+#include "daemon.h"
+#include "fail.h"
+
+void run_daemon() { fail("--daemon is supported only on Linux\n"); }
+
+#endif
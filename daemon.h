@@ -0,0 +1,8 @@
+// Resident daemon answering queries over a Unix socket (--daemon)
+
+#ifndef EXTENTS_DAEMON_H
+#define EXTENTS_DAEMON_H
+
+extern void run_daemon();
+
+#endif //EXTENTS_DAEMON_H
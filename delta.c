@@ -0,0 +1,174 @@
+/*
+ * Deltas between a file and a clone of it (--delta, --apply)
+ *
+ * --delta BASE NEW walks the two files as -c does and writes to stdout a patch holding only the regions of NEW which
+ * are not physically shared with BASE, so its size is that of the divergence, not of the files.  --apply BASE NEW
+ * reads a patch from stdin and rebuilds NEW as a clone of BASE (a copy if the filesystem can't clone) with the regions
+ * written over it, so that NEW again shares the blocks which were shared.
+ *
+ * A patch is, with all numbers 64-bit little-endian unless stated:
+ *   header:  "EXTDELTA", version (32 bits), flags (32 bits), size of BASE, size of NEW
+ *   records: logical offset, length (non-zero), the data, FNV-1a hash of the data (if flags has CHECKSUM)
+ *   end:     0, 0
+ * The hashes guard against a patch damaged in transit; the size of BASE, against applying it to the wrong base.
+ * NEW is built under a temporary name and renamed into place only once the whole patch has been applied.
+ *
+ * Where NEW reads as zeros (a hole, or an unwritten extent) but BASE may not, the record has the top bit of its length
+ * set, and no data or hash: --apply punches a hole there (or, where it can't, writes zeros).  --delta implies -S, so
+ * that unwritten extents can be trusted to read as zeros.  (Version 1 patches had no such records.)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cmp.h"
+#include "delta.h"
+#include "extents.h"
+#include "fail.h"
+#include "fiemap.h"
+#include "mem.h"
+#include "opts.h"
+#include "print.h"
+
+#define MAGIC "EXTDELTA"
+#define VERSION 2
+#define CHECKSUM 1 // flag: records carry a hash of their data
+#define ZEROS (1ULL << 63) // in the length of a record: the region reads as zeros, and no data follow
+
+#define BUF_SZ (1 << 20)
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+static uint64_t fnv(uint64_t h, unsigned char *p, size_t n) {
+    while (n-- > 0) {
+        h ^= *p++;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static void put_le(uint64_t v, unsigned n) {
+    unsigned char b[8];
+    for (unsigned i= 0; i < n; ++i, v >>= 8)
+        b[i]= (unsigned char) v;
+    if (fwrite(b, 1, n, stdout) != n) fail("Can't write patch: %s\n", strerror(errno));
+}
+
+static uint64_t get_le(unsigned n) {
+    unsigned char b[8];
+    if (fread(b, 1, n, stdin) != n) fail("Patch is truncated\n");
+    uint64_t v= 0;
+    while (n-- > 0) v= v << 8 | b[n];
+    return v;
+}
+
+static unsigned char *buf;
+
+// (a region of zeros in NEW is recorded all the same, as BASE may have data there)
+static void write_region(off_t start, off_t len, region_kind kind) {
+    fileinfo *new= &info[1];
+    len= min(len, new->size - start); // beyond the end of NEW, only BASE has data
+    if (len <= 0) return;
+    put_le((uint64_t) start, 8);
+    if (kind == ZERO_2) {
+        put_le((uint64_t) len | ZEROS, 8);
+        return;
+    }
+    put_le((uint64_t) len, 8);
+    uint64_t h= FNV_OFFSET;
+    for (off_t done= 0, n; done < len; done += n) {
+        n= pread((int) new->fd, buf, (size_t) min(len - done, BUF_SZ), start + done);
+        if (n <= 0) fail("Can't read %s : %s\n", new->name, n < 0 ? strerror(errno) : "file has shrunk");
+        if (fwrite(buf, 1, (size_t) n, stdout) != (size_t) n) fail("Can't write patch: %s\n", strerror(errno));
+        h= fnv(h, buf, (size_t) n);
+    }
+    if (delta_checksum) put_le(h, 8);
+}
+
+void write_delta() {
+    buf= malloc_s(BUF_SZ);
+    fputs(MAGIC, stdout);
+    put_le(VERSION, 4);
+    put_le(delta_checksum ? CHECKSUM : 0, 4);
+    put_le((uint64_t) info[0].size, 8);
+    put_le((uint64_t) info[1].size, 8);
+    walk_unshared(&write_region);
+    put_le(0, 8);
+    put_le(0, 8);
+    if (fflush(stdout) != 0) fail("Can't write patch: %s\n", strerror(errno));
+}
+
+static char *new_name, *tmp_name;
+
+static void abandon(char *msg) {
+    unlink(tmp_name);
+    fail("%s; %s not changed\n", msg, new_name);
+}
+
+// copy from to to, which doesn't exist
+static void copy_file(char *from, char *to) {
+    int src= open(from, O_RDONLY), dst= open(to, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (src < 0) fail("Can't open file %s : %s\n", from, strerror(errno));
+    if (dst < 0) fail("Can't create file %s : %s\n", to, strerror(errno));
+    for (ssize_t n; (n= read(src, buf, BUF_SZ)) != 0; ) {
+        if (n < 0 || write(dst, buf, (size_t) n) != n) abandon("Can't copy base");
+    }
+    close(src);
+    close(dst);
+}
+
+void apply_delta(char *base, char *new) {
+    buf= malloc_s(BUF_SZ);
+    char magic[sizeof(MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), stdin) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(magic)) != 0)
+        fail("Not a patch made by --delta\n");
+    unsigned version= (unsigned) get_le(4), flags= (unsigned) get_le(4);
+    if (version < 1 || version > VERSION)
+        fail("Patch is version %u; only versions up to %u are understood\n", version, VERSION);
+    off_t base_size= (off_t) get_le(8), new_size= (off_t) get_le(8);
+    struct stat sb;
+    if (stat(base, &sb) < 0) fail("Can't stat %s : %s\n", base, strerror(errno));
+    if (sb.st_size != base_size)
+        fail("Patch is for a base of " FIELD " bytes, but %s has " FIELD "\n", base_size, base, sb.st_size);
+
+    new_name= new;
+    tmp_name= malloc_s(strlen(new) + 32);
+    sprintf(tmp_name, "%s.delta-%d", new, (int) getpid());
+    if (!clone_file(base, tmp_name)) copy_file(base, tmp_name);
+    int fd= open(tmp_name, O_WRONLY);
+    if (fd < 0) abandon("Can't open the copy of the base");
+    memset(buf, 0, BUF_SZ);
+    for (;;) {
+        off_t start= (off_t) get_le(8);
+        uint64_t len_bits= get_le(8);
+        off_t len= (off_t) (len_bits & ~ZEROS);
+        if (len == 0) break;
+        if (start < 0 || len < 0 || start + len > new_size) abandon("Patch is corrupt");
+        if (len_bits & ZEROS) {
+            if (!punch_hole(fd, start, len))
+                for (off_t done= 0, n; done < len; done += n) {
+                    n= min(len - done, BUF_SZ);
+                    if (pwrite(fd, buf, (size_t) n, start + done) != n) abandon("Can't write");
+                }
+            continue;
+        }
+        uint64_t h= FNV_OFFSET;
+        for (off_t done= 0; done < len; ) {
+            size_t n= (size_t) min(len - done, BUF_SZ);
+            if (fread(buf, 1, n, stdin) != n) abandon("Patch is truncated");
+            if (pwrite(fd, buf, n, start + done) != (ssize_t) n) abandon("Can't write");
+            h= fnv(h, buf, n);
+            done += (off_t) n;
+        }
+        if ((flags & CHECKSUM) && get_le(8) != h) abandon("Patch is corrupt (checksum mismatch)");
+    }
+    if (ftruncate(fd, new_size) < 0 || close(fd) < 0) abandon("Can't write");
+    if (rename(tmp_name, new) < 0) abandon("Can't rename");
+}
@@ -0,0 +1,9 @@
+// Deltas between a file and a clone of it (--delta, --apply)
+
+#ifndef EXTENTS_DELTA_H
+#define EXTENTS_DELTA_H
+
+extern void write_delta();
+extern void apply_delta(char *base, char *new);
+
+#endif //EXTENTS_DELTA_H
@@ -0,0 +1,115 @@
+/*
+ * Files on several devices
+ *
+ * Sharing can't cross devices, so files on different devices are analysed separately: they are grouped by device (in
+ * order of first appearance), and each group is analysed by a child process of its own, at most jobs at a time.  Each
+ * child writes its report to a temporary file, and once all are done the reports are printed in order, a section per
+ * device.  Within a section the files are numbered as if they were the only arguments.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef linux
+#include <sys/sysmacros.h>
+#endif
+
+#include "devices.h"
+#include "extents.h"
+#include "fail.h"
+#include "mem.h"
+#include "opts.h"
+
+typedef struct group group;
+struct group {
+    dev_t dev;
+    unsigned n;  // # of files
+    char **fn;   // their names, NULL-terminated
+    FILE *out;   // report
+    pid_t pid;
+    int status;  // of the child
+};
+
+static group *groups;
+static unsigned n_groups= 0;
+
+static void group_files(char *fn[]) {
+    groups= calloc_s(nfiles, sizeof(group));
+    for (unsigned i= 0; i < nfiles; ++i) {
+        struct stat sb;
+        if (stat(fn[i], &sb) < 0) { n_groups= 1; return; } // leave it to read_ext() to complain
+        unsigned g;
+        for (g= 0; g < n_groups && groups[g].dev != sb.st_dev; ++g)
+            ;
+        if (g == n_groups) {
+            n_groups++;
+            groups[g].dev= sb.st_dev;
+            groups[g].fn= calloc_s(nfiles + 1, sizeof(char *));
+        }
+        groups[g].fn[groups[g].n++]= fn[i];
+    }
+}
+
+bool on_several_devices(char *fn[]) {
+    group_files(fn);
+    return n_groups > 1;
+}
+
+static void start(group *g) {
+    g->out= tmpfile();
+    if (g->out == NULL) fail("Can't create temporary file: %s\n", strerror(errno));
+    fflush(stdout);
+    g->pid= fork();
+    if (g->pid < 0) fail("Can't fork: %s\n", strerror(errno));
+    if (g->pid == 0) {
+        if (dup2(fileno(g->out), STDOUT_FILENO) < 0) fail("Can't redirect output: %s\n", strerror(errno));
+        nfiles= g->n;
+        analyse(g->fn);
+        fflush(stdout);
+        exit(0);
+    }
+}
+
+// wait for any child to finish
+static void reap() {
+    int status;
+    pid_t pid= wait(&status);
+    if (pid < 0) fail("wait failed: %s\n", strerror(errno));
+    for (unsigned g= 0; g < n_groups; ++g)
+        if (groups[g].pid == pid)
+            groups[g].status= status;
+}
+
+static void print_section(group *g) {
+    if (no_headers) printf("%u:%u\n", major(g->dev), minor(g->dev));
+    else printf("Device %u:%u:\n", major(g->dev), minor(g->dev));
+    rewind(g->out);
+    char buf[BUFSIZ];
+    for (size_t n; (n= fread(buf, 1, sizeof(buf), g->out)) > 0; )
+        fwrite(buf, 1, n, stdout);
+    fclose(g->out);
+}
+
+// Returns the exit status: that of the first group which failed, if any.
+int analyse_by_device() {
+    unsigned running= 0;
+    for (unsigned g= 0; g < n_groups; ++g) {
+        if (running == jobs) { reap(); running--; }
+        start(&groups[g]);
+        running++;
+    }
+    for (; running > 0; running--) reap();
+    int res= 0;
+    for (unsigned g= 0; g < n_groups; ++g) {
+        if (g > 0) putchar('\n');
+        print_section(&groups[g]);
+        int st= groups[g].status;
+        if (res == 0 && !(WIFEXITED(st) && WEXITSTATUS(st) == 0))
+            res= WIFEXITED(st) ? WEXITSTATUS(st) : 1;
+    }
+    return res;
+}
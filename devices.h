@@ -0,0 +1,11 @@
+// Analysing files on several devices, a device at a time in parallel
+
+#ifndef EXTENTS_DEVICES_H
+#define EXTENTS_DEVICES_H
+
+#include <stdbool.h>
+
+extern bool on_several_devices(char *fn[]);
+extern int analyse_by_device();
+
+#endif //EXTENTS_DEVICES_H
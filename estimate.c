@@ -0,0 +1,130 @@
+/*
+ * Estimating sharing by sampling (--estimate)
+ *
+ * Instead of mapping every extent, pick random blocks of the files in turn and map only the block itself, until the
+ * time budget runs out or every file has had as many samples as it has blocks.  The filesystem flags the extent it
+ * returns as shared if any other extent maps the same physical blocks, so each sample is classified on the spot: shared,
+ * exclusive, or a hole if it is unmapped.  No file is mapped in full and nothing is sorted, so the budget bounds the
+ * whole run.  (Shared here means shared with anything: with another file, whether or not it is among those given, with
+ * the same file at another offset, or with a snapshot.)
+ *
+ * Each sample is classified exactly, so the fraction of a file's samples which are shared, scaled by its size, is an
+ * unbiased estimate of its shared bytes (likewise for exclusive bytes), with a Wilson score interval at 95% confidence.
+ * The interval for the total is the sum of those of the files.  That is conservative (it holds whenever all of theirs
+ * do), but unlike a normal approximation it doesn't collapse to a point when no sample, or every sample, is shared.
+ *
+ * FIEMAP's shared flag is what makes this work, so --estimate is supported only on Linux.
+ */
+
+#ifdef linux
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "estimate.h"
+#include "extents.h"
+#include "fiemap.h"
+#include "mem.h"
+#include "opts.h"
+#include "print.h"
+
+#define Z 1.96 // for 95% confidence
+
+typedef enum { HOLE, EXCLUSIVE, SHARED } kind;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static off_t random_off(off_t n) {
+    unsigned long r= (unsigned long) random() << 31 | (unsigned long) random();
+    return (off_t) (r % (unsigned long) n);
+}
+
+static off_t n_blocks(fileinfo *fi) { return (fi->size + blk_sz - 1) / blk_sz; }
+
+// Classify a random block of fi by mapping just that block.  Returns false if its map was changing, in which case the
+// sample is discarded.
+static bool take_sample(fileinfo *fi, kind *k) {
+    off_t l= random_off(n_blocks(fi)) * blk_sz;
+    bool ok= get_extents(fi, l, blk_sz);
+    if (ok) {
+        *k= HOLE;
+        for (unsigned i= 0; i < fi->n_exts; ++i) {
+            extent *e= &fi->exts[i];
+            if (e->l <= l && l < end_l(e)) *k= flags_are_shared(e->flags) ? SHARED : EXCLUSIVE;
+        }
+    }
+    free(fi->exts);
+    fi->exts= NULL;
+    fi->n_exts= 0;
+    return ok;
+}
+
+// Wilson score interval for k of n samples of a file of size bytes
+static estimate wilson(unsigned long k, unsigned long n, off_t size) {
+    estimate res= { 0, 0, 0 };
+    if (n == 0) { res.hi= size; return res; }
+    double ph= (double) k / n, z2= Z * Z;
+    double centre= (ph + z2 / (2 * n)) / (1 + z2 / n);
+    double half= Z / (1 + z2 / n) * sqrt(ph * (1 - ph) / n + z2 / (4.0 * n * n));
+    res.est= (off_t) (ph * size);
+    res.lo= (off_t) (max(centre - half, 0.0) * size);
+    res.hi= (off_t) (min(centre + half, 1.0) * size);
+    return res;
+}
+
+static void add_to_total(estimate *t, estimate e) {
+    t->est += e.est;
+    t->lo += e.lo;
+    t->hi += e.hi;
+}
+
+void estimate_sharing() {
+    srandom(1); // reproducible, for a given budget and set of files
+    double begin= now(), deadline= begin + estimate_secs;
+    unsigned long n_samples= 0, holes= 0, taken[nfiles], n[nfiles], shared_n[nfiles], excl_n[nfiles];
+    for (unsigned i= 0; i < nfiles; ++i)
+        taken[i]= n[i]= shared_n[i]= excl_n[i]= 0;
+    for (bool more= true; more && now() < deadline; ) {
+        more= false;
+        for (unsigned i= 0; i < nfiles; ++i) {
+            fileinfo *fi= &info[i];
+            if (taken[i] >= (unsigned long) n_blocks(fi)) continue;
+            more= true;
+            taken[i]++; // counts attempts, so that a file whose map keeps changing can't go on forever
+            kind k;
+            if (!take_sample(fi, &k)) continue;
+            n_samples++;
+            n[i]++;
+            if (k == HOLE) holes++;
+            else if (k == SHARED) shared_n[i]++;
+            else excl_n[i]++;
+        }
+    }
+    double secs= now() - begin;
+
+    print_estimate_header(n_samples, holes, secs);
+    estimate tot_sh= { 0, 0, 0 }, tot_ex= { 0, 0, 0 };
+    for (unsigned i= 0; i < nfiles; ++i) {
+        off_t size= info[i].size;
+        estimate sh= wilson(shared_n[i], n[i], size), ex= wilson(excl_n[i], n[i], size);
+        print_estimate(i + 1, n[i], sh, ex);
+        add_to_total(&tot_sh, sh);
+        add_to_total(&tot_ex, ex);
+    }
+    if (nfiles > 1) print_estimate(0, n_samples, tot_sh, tot_ex);
+}
+
+#else
+
+#include "estimate.h"
+#include "fail.h"
+
+void estimate_sharing() { fail("--estimate is supported only on Linux\n"); }
+
+#endif
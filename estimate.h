@@ -0,0 +1,16 @@
+// Estimating shared and exclusive bytes by sampling (--estimate)
+
+#ifndef EXTENTS_ESTIMATE_H
+#define EXTENTS_ESTIMATE_H
+
+#include <sys/types.h>
+
+// an estimated number of bytes with its 95% confidence interval
+typedef struct estimate estimate;
+struct estimate {
+    off_t est, lo, hi;
+};
+
+extern void estimate_sharing();
+
+#endif //EXTENTS_ESTIMATE_H
@@ -8,12 +8,14 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "fail.h"
 #include "mem.h"
@@ -25,10 +27,21 @@
 #include "opts.h"
 #include "sharing.h"
 #include "sorting.h"
+#include "phys.h"
+#include "query.h"
+#include "daemon.h"
+#include "coalesce.h"
+#include "estimate.h"
+#include "devices.h"
+#include "delta.h"
+#include "frag.h"
+#include "clusters.h"
+#include "checksum.h"
+#include "shard.h"
 
-static dev_t device;
+dev_t device;
 blksize_t blk_sz;
-unsigned n_ext= 0;
+size_t n_ext= 0;
 
 unsigned nfiles;
 fileinfo *info;
@@ -39,6 +52,74 @@ off_t end_l(extent *e) { return e->l + e->len; }
 
 static off_t end_p(extent *e) { return e->p + e->len; }
 
+#define BACKOFF_US 10000 // initial delay before re-mapping an unstable file; doubles on each retry
+
+// whether the file's extents have all been allocated (other unexpected flags, as of compressed or inline data, don't
+// go away, so are not waited for but reported by the analyses which can't handle them)
+static bool extents_are_settled(fileinfo *fi) {
+    for (unsigned i= 0; i < fi->n_exts; ++i)
+        if (!flags_are_settled(fi->exts[i].flags))
+            return false;
+    return true;
+}
+
+// number the extents, which are in logical order
+static void number_extents(fileinfo *fi) {
+    for (unsigned i= 0; i < fi->n_exts; ++i)
+        fi->exts[i].seq= i;
+}
+
+// Map the extents of [start, start+len).  Without -S a changing file is fatal.  With -S the file's dirty data are
+// flushed first, and a map that is changing or still has extents not yet allocated is retried, backing off exponentially,
+// up to max_retries times.  Returns false if the map never settled.  With --coalesce, the extents of a stable map are
+// coalesced.  An empty range (as of an empty file) has no extents; FIEMAP would reject it.
+bool map_extents(fileinfo *fi, off_t start, off_t len) {
+    fi->attempts= 1;
+    if (len <= 0) {
+        fi->exts= NULL;
+        fi->n_exts= 0;
+        return fi->stable= true;
+    }
+    if (!sync_extents) {
+        if (!get_extents(fi, start, len))
+            fail("file is changing: %s; number of extents changed\n", fi->name);
+        if (coalesce) coalesce_extents(fi);
+        number_extents(fi);
+        return fi->stable= true;
+    }
+    for (useconds_t backoff= BACKOFF_US; ; backoff *= 2, fi->attempts++) {
+        if (get_extents(fi, start, len) && extents_are_settled(fi)) {
+            if (coalesce) coalesce_extents(fi);
+            number_extents(fi);
+            return fi->stable= true;
+        }
+        if (fi->attempts > max_retries)
+            return fi->stable= false;
+        free(fi->exts);
+        fi->exts= NULL;
+        usleep(backoff);
+    }
+}
+
+// keep only those parts of the file's extents that lie within [from, to)
+void trim_extents(fileinfo *fi, off_t from, off_t to) {
+    unsigned n= 0;
+    for (unsigned i= 0; i < fi->n_exts; ++i) {
+        extent e= fi->exts[i];
+        if (end_l(&e) <= from || e.l >= to) continue;
+        if (e.l < from) {
+            off_t head= from - e.l;
+            e.l= from;
+            e.p += head;
+            e.len -= head;
+        }
+        if (end_l(&e) > to) e.len= to - e.l;
+        e.seq= n;
+        fi->exts[n++]= e;
+    }
+    fi->n_exts= n;
+}
+
 static void read_ext(char *fn[]) {
     info= calloc_s(nfiles, sizeof(fileinfo));
     for (unsigned i= 0; i < nfiles; ++i) {
@@ -66,7 +147,22 @@ static void read_ext(char *fn[]) {
             if (i == 0) info[0].skip= skip1;
             else if (i == 1) info[1].skip= skip2;
         }
-        get_extents(&info[i], max_cmp);
+        if (cmp_output || delta_mode) continue; // mapped lazily, a window at a time, by walk_unshared()
+        if (estimate_mode) continue; // sampled, a block at a time, by estimate_sharing()
+        off_t skip= info[i].skip;
+        range *w= range_of(name);
+        bool mapped;
+        if (w != NULL) { // only the window is mapped, and extents straddling its ends are trimmed to it
+            off_t to= min(sb.st_size, w->off + w->len);
+            mapped= w->off >= to || map_extents(&info[i], w->off, to - w->off);
+            if (mapped && w->off < to) trim_extents(&info[i], w->off, to);
+        } else
+            mapped= map_extents(&info[i], skip, max_cmp > 0 ? max_cmp : sb.st_size - skip);
+        if (!mapped) {
+            free(info[i].exts); // leave it out
+            info[i].exts= NULL;
+            info[i].n_exts= 0;
+        }
         unsigned n= info[i].n_exts;
         n_ext += n;
         if (n > 0) {
@@ -75,9 +171,11 @@ static void read_ext(char *fn[]) {
             if (end_last > sb.st_size) // truncate last extent to file size
                 last_e->len -= (end_last - sb.st_size);
         }
-        close(fd);
+        if (!checksum_mode) close(fd); // read by report_checksums()
     }
-    extents= new_list(-(int)n_ext);
+    if (cmp_output || delta_mode || estimate_mode) return;
+    if (sync_extents) print_stability_report(true);
+    extents= new_list(-(ssize_t) max(n_ext, 1)); // exactly
     for (unsigned i= 0; i < nfiles; ++i)
         for (unsigned e= 0; e < info[i].n_exts; ++e)
             append(extents, &info[i].exts[e]);
@@ -90,19 +188,74 @@ void check_all_extents_are_sane() {
     })
 }
 
-int main(int argc, char *argv[]) {
-    args(argc, argv);
-    read_ext(&argv[optind]);
-    if (print_extents_only)
+#define FLUSH_REGIONS 1024 // with --stream, stdout is flushed after this many regions
+#define FLUSH_MS 100       // or once this long has passed since it last was
+
+static long ms_since(struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+// With --stream, each region is printed as soon as the sweep finishes it, then freed.  The next stage of a pipe
+// consumes regions as they appear, but flushing after each would cost a write per line, so they go out in batches.
+static void stream_region(sh_ext *s) {
+    static unsigned unflushed= 0;
+    static struct timespec flushed; // when stdout was last flushed (zero at first, so the first region goes at once)
+    bool sh= n_owners(s) > 1;
+    if (sh ? !print_unshared_only : !print_shared_only) {
+        print_region(s);
+        if (++unflushed >= FLUSH_REGIONS || ms_since(&flushed) >= FLUSH_MS) {
+            fflush(stdout);
+            unflushed= 0;
+            clock_gettime(CLOCK_MONOTONIC, &flushed);
+        }
+    }
+    free(s);
+}
+
+// analyse the nfiles files fn (with --merge, the files of the nfiles shards fn), which are on one device
+void analyse(char *fn[]) {
+    if (merge_mode) read_shards(fn);
+    else read_ext(fn);
+    if (emit_shard)
+        write_shard();
+    else if (print_extents_only)
         print_extents_by_file();
     else if (cmp_output)
         generate_cmp_output();
-    else {
+    else if (all_pairs)
+        generate_all_pairs_output();
+    else if (delta_mode)
+        write_delta();
+    else if (estimate_mode)
+        estimate_sharing();
+    else if (phys_ranges != NULL)
+        answer_phys_queries();
+    else if (frag_mode)
+        report_fragmentation();
+    else if (clusters_mode) {
+        find_shares();
+        report_clusters();
+    }
+    else if (checksum_mode)
+        report_checksums();
+    else if (query_mode) {
         find_shares();
+        if (coalesce) coalesce_shares();
+        build_query_index();
+        serve_queries(stdin, stdout);
+    } else if (daemon_socket != NULL)
+        run_daemon();
+    else if (stream_output) {
+        region_sink= &stream_region;
+        find_shares();
+    } else {
+        find_shares();
+        if (coalesce) coalesce_shares();
      	bool pr_sh= !print_unshared_only && !is_empty(shared);
         bool pr_unsh= !print_shared_only && total_unshared > 0;
         if (pr_sh) {
-	        ITER(shared, sh_ext*, sh_e, fileno_sort(((sh_ext *)sh_e)->owners))
             log_sort(shared);
             if (no_headers)
                 print_shared_extents_no_header();
@@ -116,5 +269,22 @@ int main(int argc, char *argv[]) {
         if (pr_sh && pr_unsh || no_headers) putchar('\n');
         if (pr_unsh) print_unshared_extents();
     }
+    if (coalesce && !cmp_output && !delta_mode) print_coalesce_report();
+}
+
+int main(int argc, char *argv[]) {
+    args(argc, argv);
+    char **fn= &argv[optind];
+    if (apply_mode) {
+        apply_delta(fn[0], fn[1]);
+        return 0;
+    }
+    if (!merge_mode && on_several_devices(fn)) { // the files of shards are all on one device
+        if (cmp_output || all_pairs || delta_mode || phys_ranges != NULL || query_mode || daemon_socket != NULL || estimate_mode
+            || emit_shard)
+            fail("Error: All files must be on the same filesystem (except for the sharing report, -P, --frag, --clusters and --checksum)!\n");
+        return analyse_by_device();
+    }
+    analyse(fn);
     return 0;
 }
@@ -15,6 +15,8 @@ struct extent {
     off_t p;         // physical offset on device
     off_t len;
     unsigned flags;
+    unsigned seq;    // index in its file's exts, so in logical order (pieces split from it keep it)
+    bool split;      // allocated by find_shares() to hold the remainder of a split extent
 };
 
 // description of file
@@ -27,6 +29,8 @@ struct fileinfo {
     extent *exts;       // ptr to first extent in array of size n_exts
     list *unsh;         // unshared extents, list of sh_ext* (solely owned by this file)
     off_t skip;         // # of bytes to skip over
+    unsigned attempts;  // # of times the file was mapped before its extents were stable (-S)
+    bool stable;        // false if the extents never settled, in which case the file is left out
 };
 
 #define min(a,b) ({                                   \
@@ -38,15 +42,22 @@ struct fileinfo {
      _a > _b ? _a : _b; })
 
 extern blksize_t blk_sz;
+extern dev_t device; // of the files
 
 extern unsigned nfiles;
 extern fileinfo *info; // ptr to array of files' info of size nfiles
-extern unsigned n_ext; // # of extents in all files
+extern size_t n_ext; // # of extents in all files
 
 extern list *extents; // list of all extent* from all files
 
 extern off_t end_l(extent *e);
 
+extern void trim_extents(fileinfo *fi, off_t from, off_t to);
+
+extern bool map_extents(fileinfo *fi, off_t start, off_t len);
+
 extern void check_all_extents_are_sane();
 
+extern void analyse(char *fn[]);
+
 #endif
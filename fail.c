@@ -5,6 +5,7 @@
 #include "fail.h"
 
 bool fail_silently= false;
+jmp_buf *fail_catch= NULL;
 
 void fail(const char *fmt, ...) {
     if (!fail_silently) {
@@ -13,5 +14,6 @@ void fail(const char *fmt, ...) {
         vfprintf(stderr, fmt, args);
         va_end(args);
     }
+    if (fail_catch != NULL) longjmp(*fail_catch, 1);
     exit(1);
 }
@@ -1,5 +1,7 @@
+#include <setjmp.h>
 #include <stdbool.h>
 
 extern bool fail_silently;
+extern jmp_buf *fail_catch; // if set, fail() jumps here (once the message is out) instead of exiting
 
 extern void fail(const char *fmt, ...);
@@ -6,5 +6,11 @@
 #define roundDown(a, b) ((a) / (b) * (b))
 
 extern void flags2str(unsigned flags, char *s, size_t n, bool sharing);
-extern void get_extents(fileinfo *ip, off_t max_len);
+extern bool get_extents(fileinfo *ip, off_t start, off_t len);
 extern bool flags_are_sane(unsigned flags);
+extern bool flags_are_settled(unsigned flags);
+extern bool reads_as_zeros(unsigned flags);
+extern bool flags_are_shared(unsigned flags);
+extern bool merge_flags(unsigned *f1, unsigned f2);
+extern bool clone_file(char *from, char *to);
+extern bool punch_hole(int fd, off_t start, off_t len);
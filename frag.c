@@ -0,0 +1,98 @@
+/*
+ * Fragmentation and read locality (--frag)
+ *
+ * For each file, from its extents in logical order: the # of extents and the distribution of their lengths; the
+ * total physical distance jumped by a sequential read (from the end of each extent to the start of the next); the
+ * share of the bytes in small extents; and how many of the jumps are next to an extent shared with another of the
+ * files (defragmenting the file would unshare it).  Files are ranked by the distance jumped, then by # of
+ * extents, so the first are the ones most worth defragmenting or re-cloning.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "extents.h"
+#include "frag.h"
+#include "lists.h"
+#include "mem.h"
+#include "opts.h"
+#include "phys.h"
+#include "print.h"
+#include "sorting.h"
+
+static int off_t_cmp(const void *a, const void *b) {
+    off_t x= *(const off_t *) a, y= *(const off_t *) b;
+    return x > y ? 1 : x < y ? -1 : 0;
+}
+
+// the q'th percentile (nearest rank) of the n sorted lengths
+static off_t percentile(off_t *lens, unsigned n, unsigned q) {
+    unsigned rank= (unsigned) (((unsigned long) q * n + 99) / 100);
+    return lens[rank > 0 ? rank - 1 : 0];
+}
+
+static bool shared_with_other(phys_index *pi, extent *e) {
+    ITER_OVERLAPPING(pi, e->p, e->len, o, {
+        if (o->info != e->info) return true;
+    })
+    return false;
+}
+
+static void measure(fileinfo *fi, phys_index *pi, frag *fr) {
+    fr->file= fi->argno;
+    fr->n_exts= fi->n_exts;
+    if (fi->n_exts == 0) return;
+    off_t *lens= malloc_s(fi->n_exts * sizeof(off_t));
+    off_t total= 0, small= 0;
+    bool prev_shared= false;
+    for (unsigned i= 0; i < fi->n_exts; ++i) {
+        extent *e= &fi->exts[i];
+        lens[i]= e->len;
+        total += e->len;
+        if (e->len < frag_small) small += e->len;
+        bool sh= shared_with_other(pi, e);
+        if (i > 0) {
+            extent *prev= &fi->exts[i - 1];
+            off_t jump= e->p - (prev->p + prev->len);
+            if (jump != 0) {
+                fr->seek += jump < 0 ? -jump : jump;
+                if (sh || prev_shared) fr->shared_breaks++;
+            }
+        }
+        prev_shared= sh;
+    }
+    qsort(lens, fi->n_exts, sizeof(off_t), &off_t_cmp);
+    fr->mean= total / fi->n_exts;
+    fr->p50= percentile(lens, fi->n_exts, 50);
+    fr->p90= percentile(lens, fi->n_exts, 90);
+    fr->p99= percentile(lens, fi->n_exts, 99);
+    fr->small= total > 0 ? 100.0 * (double) small / (double) total : 0;
+    free(lens);
+}
+
+// most seeking first
+static int frag_cmp(const void *a, const void *b) {
+    const frag *x= a, *y= b;
+    return x->seek < y->seek ? 1
+         : x->seek > y->seek ? -1
+         : x->n_exts < y->n_exts ? 1
+         : x->n_exts > y->n_exts ? -1
+         : x->file > y->file ? 1
+         : x->file < y->file ? -1
+         : 0;
+}
+
+void report_fragmentation() {
+    phys_sort_extents();
+    phys_index *pi= new_phys_index(extents);
+    frag *frs= calloc_s(nfiles, sizeof(frag));
+    for (unsigned i= 0; i < nfiles; ++i)
+        measure(&info[i], pi, &frs[i]);
+    qsort(frs, nfiles, sizeof(frag), &frag_cmp);
+    print_frag_header();
+    for (unsigned i= 0; i < nfiles; ++i)
+        print_frag(i + 1, &frs[i]);
+    free(frs);
+    free(pi->reach);
+    free(pi);
+}
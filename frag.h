@@ -0,0 +1,20 @@
+// Fragmentation and read locality of each file (--frag)
+
+#ifndef EXTENTS_FRAG_H
+#define EXTENTS_FRAG_H
+
+#include <sys/types.h>
+
+typedef struct frag frag;
+struct frag {
+    unsigned file;          // argno
+    unsigned n_exts;
+    off_t mean, p50, p90, p99;  // extent lengths
+    off_t seek;             // total physical distance jumped reading the file sequentially
+    double small;           // % of the bytes in extents shorter than frag_small
+    unsigned shared_breaks; // jumps next to an extent shared with another file
+};
+
+extern void report_fragmentation();
+
+#endif //EXTENTS_FRAG_H
@@ -1,17 +1,19 @@
 // a generic list-of-pointer-to-something
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lists.h"
 #include "mem.h"
 
-unsigned n_elems(list *ps) { return ps->nelems; }
+size_t n_elems(list *ps) { return ps->nelems; }
 
 #define GET(ps, i) ((ps)->elems[i])
 
-void *get(list *ps, unsigned i) { assert(n_elems(ps) > i); return GET(ps, i); }
+void *get(list *ps, size_t i) { assert(n_elems(ps) > i); return GET(ps, i); }
 
-void put(list *ps, unsigned i, void *e) { assert(n_elems(ps) > i); GET(ps, i)= e; }
+void put(list *ps, size_t i, void *e) { assert(n_elems(ps) > i); GET(ps, i)= e; }
 
 bool is_empty(list *ps)     { return n_elems(ps) == 0; }
 
@@ -25,24 +27,57 @@ void *only(list *ps) { assert(is_singleton(ps)); return first(ps); }
 
 void *last(list *ps) { return GET(ps, n_elems(ps) - 1); }
 
+static size_t capacity(list *ps) { return ps->max_sz < 0 ? -ps->max_sz : ps->max_sz; }
+
+// resize the elems of growable ps to hold n; big arrays (see mem.c) grow in place where they can
+static void resize(list *ps, size_t n) {
+    size_t old_sz= capacity(ps) * sizeof(void *), sz= n * sizeof(void *);
+    if (ps->big)
+        ps->elems= realloc_big(ps->elems, old_sz, sz);
+    else if (sz >= BIG_SZ) {
+        void **elems= alloc_big(sz);
+        memcpy(elems, ps->elems, old_sz);
+        free(ps->elems);
+        ps->elems= elems;
+        ps->big= true;
+    } else
+        ps->elems= realloc_s(ps->elems, sz);
+    ps->max_sz= -(ssize_t) n;
+}
+
 // -ve max_sz means growable, abs value is initial size
 // Caution: if growable, elems[] can be realloc'ed when growing, so don't keep pointers into the array.
-list *new_list(int max_sz) {
+list *new_list(ssize_t max_sz) {
     assert(max_sz != 0);
-    unsigned max_sz_abs= max_sz < 0 ? -max_sz : max_sz;
     list *ps= malloc_s(sizeof(list));
     ps->nelems= 0;
     ps->max_sz= max_sz;
-    ps->elems= calloc_s(max_sz_abs, sizeof(void *));
+    size_t sz= capacity(ps) * sizeof(void *);
+    ps->big= sz >= BIG_SZ;
+    ps->elems= ps->big ? alloc_big(sz) : calloc_s(capacity(ps), sizeof(void *));
     return ps;
 }
 
 list *append(list *ps, void *e) {
-    assert(ps->max_sz < 0 || n_elems(ps) < ps->max_sz);
-    if (ps->max_sz < 0 && n_elems(ps) == -ps->max_sz) {
-        ps->max_sz *= 2;
-        ps->elems= realloc_s(ps->elems, (-ps->max_sz) * sizeof(void *));
-    }
+    assert(ps->max_sz < 0 || n_elems(ps) < capacity(ps));
+    if (ps->max_sz < 0 && n_elems(ps) == capacity(ps))
+        resize(ps, 2 * capacity(ps));
     put(ps, ps->nelems++, e);
     return ps;
 }
+
+void splice(list *ps, size_t from, size_t to, list *ins) {
+    assert(ps->max_sz < 0 && from <= to && to <= n_elems(ps));
+    size_t n_ins= n_elems(ins), n= n_elems(ps) - (to - from) + n_ins;
+    if (n > capacity(ps))
+        resize(ps, n);
+    memmove(&GET(ps, from + n_ins), &GET(ps, to), (n_elems(ps) - to) * sizeof(void *));
+    if (n_ins > 0) memcpy(&GET(ps, from), &GET(ins, 0), n_ins * sizeof(void *));
+    ps->nelems= n;
+}
+
+void free_list(list *ps) {
+    if (ps->big) free_big(ps->elems, capacity(ps) * sizeof(void *));
+    else free(ps->elems);
+    free(ps);
+}
@@ -4,30 +4,33 @@
 #define EXTENTS_LISTS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 typedef struct list list;
 
 struct list {
-    unsigned nelems;
-    int max_sz; // negative means growable
+    size_t nelems;
+    ssize_t max_sz; // negative means growable
+    bool big;       // elems is from alloc_big()
     void **elems;
 };
 
 #define ITER(l, EL_T, elem, stmt) {             \
   list *_l= (l);                                \
-  for (unsigned _i= 0; _i < _l->nelems; ++_i) { \
+  for (size_t _i= 0; _i < _l->nelems; ++_i) {   \
     EL_T (elem)= get(_l, _i);                   \
     do { stmt; } while (0);                     \
   }}
 
-extern unsigned n_elems(list *ps);
+extern size_t n_elems(list *ps);
 
 // use this if you need the l-value of an element
 #define GET(ps, i) ((ps)->elems[i])
 
-extern void *get(list *ps, unsigned i);
+extern void *get(list *ps, size_t i);
 
-extern void put(list *ps, unsigned i, void *e);
+extern void put(list *ps, size_t i, void *e);
 
 extern bool is_empty(list *ps);
 
@@ -43,8 +46,14 @@ extern void *last(list *ps);
 
 // -ve max_sz means growable, abs value is initial size
 // Caution: if growable, elems[] can be realloc'ed when growing, so don't keep pointers into the array.
-extern list *new_list(int max_sz);
+extern list *new_list(ssize_t max_sz);
 
 extern list *append(list *ps, void *e);
 
+// replace elements [from, to) of growable ps with the elements of ins
+extern void splice(list *ps, size_t from, size_t to, list *ins);
+
+// frees the list, not the elements
+extern void free_list(list *ps);
+
 #endif //EXTENTS_LISTS_H
@@ -1,6 +1,15 @@
+#ifdef linux
+#define _GNU_SOURCE // for mremap
+#endif
+
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #include "fail.h"
 #include "mem.h"
+#include "opts.h"
 
 void *malloc_s(size_t size) {
     void *res= malloc(size);
@@ -24,3 +33,55 @@ void *realloc_s(void *mem, size_t size)
         fail("realloc failed!\n");
     return res;
 }
+
+/*
+ * Big arrays
+ *
+ * Arrays of BIG_SZ bytes or more are anonymous mappings.  On Linux they grow with mremap(2), which moves pages rather
+ * than copying them, so a growing array never needs its old and new copies at once.  With --hugepages they are backed
+ * by huge pages: explicitly (MAP_HUGETLB) if any are reserved, else by asking for transparent huge pages.
+ */
+
+#define HUGE_PAGE_SZ (2UL << 20)
+
+static size_t big_size(size_t size) {
+    size_t unit= hugepages ? HUGE_PAGE_SZ : (size_t) sysconf(_SC_PAGESIZE);
+    return (size + unit - 1) / unit * unit;
+}
+
+// a zeroed array of (at least) size bytes
+void *alloc_big(size_t size) {
+    size= big_size(size);
+    void *res= MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugepages)
+        res= mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (res == MAP_FAILED) {
+        res= mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (res == MAP_FAILED)
+            fail("mmap of %lu bytes failed!\n", (unsigned long) size);
+#ifdef MADV_HUGEPAGE
+        if (hugepages) madvise(res, size, MADV_HUGEPAGE);
+#endif
+    }
+    return res;
+}
+
+// grow the big array m, of old_size bytes, to size bytes
+void *realloc_big(void *m, size_t old_size, size_t size) {
+    old_size= big_size(old_size);
+    if (big_size(size) == old_size) return m;
+#ifdef linux
+    void *res= mremap(m, old_size, big_size(size), MREMAP_MAYMOVE);
+    if (res != MAP_FAILED) return res;
+#endif
+    void *new= alloc_big(size);
+    memcpy(new, m, old_size < size ? old_size : size);
+    free_big(m, old_size);
+    return new;
+}
+
+void free_big(void *m, size_t size) {
+    munmap(m, big_size(size));
+}
@@ -5,3 +5,10 @@
 extern void *malloc_s(size_t size);
 extern void *calloc_s(size_t n, size_t size);
 extern void *realloc_s(void *m, size_t size);
+
+#define BIG_SZ (1UL << 20) // bytes from which an array is allocated with alloc_big()
+
+// anonymous mappings, for big arrays
+extern void *alloc_big(size_t size);
+extern void *realloc_big(void *m, size_t old_size, size_t size);
+extern void free_big(void *m, size_t size);
@@ -0,0 +1,272 @@
+/*
+ * Linux program to make families of clonefiles, for benchmarking extents and ccmp.
+ *
+ * Builds FILES files in DIR, in families of DEGREE: each family's base is DEGREE-1 times cloned (FICLONE), and each
+ * clone then has OVERWRITES random runs of blocks overwritten.  A base is first assembled, by FICLONERANGE, from
+ * PIECES pieces of a scratch file of random data, in shuffled order, so it is fragmented into (about) PIECES extents;
+ * then SELF runs of its blocks are cloned over other blocks of itself.  All data and choices come from a generator
+ * seeded with SEED, so the same arguments make the same files (and manifest) on any machine.
+ *
+ * The manifest (on stdout, or to -m FILE) gives, for each file, its size and expected shared and exclusive bytes, then
+ * its blocks as runs "OFFSET LENGTH ID": the blocks of a run hold consecutive blocks of data ID, ID+1, ...; blocks
+ * with the same ID (in any files) share a physical block.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "fail.h"
+
+#define BUF_SZ (1 << 20) // data are written through a buffer of this size
+#define MAX_RUN 16       // longest run of blocks overwritten or self-cloned
+
+static void usage() {
+    fail("usage: mkclones [-s SEED] [-n FILES] [-d DEGREE] [-S SIZE] [-b BLOCK] [-F PIECES] [-w OVERWRITES]\n"
+         "                [-x SELF] [-m MANIFEST] DIR\n"
+         "  SIZE and BLOCK may have a suffix of K, M or G\n");
+}
+
+static unsigned long
+    seed= 1,
+    n_files= 4,    // in all
+    degree= 4,     // files per family
+    size= 64 << 20,
+    blk= 0,        // default: the block size of DIR
+    pieces= 1,     // per base
+    overwrites= 8, // per clone
+    self= 0;       // runs of each base cloned over itself
+
+static char *dir, *manifest_fn= NULL;
+
+static FILE *manifest;
+
+// xorshift64*
+static uint64_t state;
+
+static uint64_t rnd() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+// uniform in [0, n)
+static uint64_t rnd_below(uint64_t n) { return rnd() % n; }
+
+static unsigned long parse_size(char *s, char opt) {
+    char *end;
+    unsigned long res= strtoul(s, &end, 10);
+    switch (*end) {
+        case 'G': case 'g': res <<= 10; // fall through
+        case 'M': case 'm': res <<= 10; // fall through
+        case 'K': case 'k': res <<= 10; end++;
+        default: break;
+    }
+    if (end == s || *end != '\0') fail("bad number for -%c: %s\n", opt, s);
+    return res;
+}
+
+static void args(int argc, char *argv[]) {
+    for (int c; c= getopt(argc, argv, "s:n:d:S:b:F:w:x:m:"), c != -1; ) {
+        switch (c) {
+            case 's': seed=       parse_size(optarg, c); break;
+            case 'n': n_files=    parse_size(optarg, c); break;
+            case 'd': degree=     parse_size(optarg, c); break;
+            case 'S': size=       parse_size(optarg, c); break;
+            case 'b': blk=        parse_size(optarg, c); break;
+            case 'F': pieces=     parse_size(optarg, c); break;
+            case 'w': overwrites= parse_size(optarg, c); break;
+            case 'x': self=       parse_size(optarg, c); break;
+            case 'm': manifest_fn= optarg; break;
+            default : usage();
+        }
+    }
+    if (optind != argc - 1 || n_files == 0 || degree == 0 || pieces == 0) usage();
+    dir= argv[optind];
+}
+
+static int open_new(char *name) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd= open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) fail("open of %s failed: %s\n", path, strerror(errno));
+    return fd;
+}
+
+// write len bytes of random data at off
+static void write_random(int fd, off_t off, off_t len) {
+    static uint64_t *buf= NULL;
+    if (buf == NULL && (buf= malloc(BUF_SZ)) == NULL) fail("malloc failed!\n");
+    while (len > 0) {
+        size_t n= len < BUF_SZ ? (size_t) len : BUF_SZ;
+        for (size_t i= 0; i < (n + 7) / 8; ++i)
+            buf[i]= rnd();
+        if (pwrite(fd, buf, n, off) != (ssize_t) n) fail("write failed: %s\n", strerror(errno));
+        off += n;
+        len -= n;
+    }
+}
+
+static void clone_range(int src, off_t src_off, int dst, off_t dst_off, off_t len) {
+    struct file_clone_range r= { src, (uint64_t) src_off, (uint64_t) len, (uint64_t) dst_off };
+    if (ioctl(dst, FICLONERANGE, &r) < 0) fail("FICLONERANGE failed: %s\n", strerror(errno));
+}
+
+/*
+ * The model of the files: the ID of the data in each block.  IDs are allocated afresh for each block written, so two
+ * blocks share a physical block exactly when their IDs are the same.
+ */
+
+static uint64_t n_ids;      // IDs allocated so far
+static uint64_t fam_ids;    // the first ID of the current family
+static unsigned long n_blk; // blocks per file
+
+// the blocks of a new file
+static uint64_t *new_blocks() {
+    uint64_t *res= malloc(n_blk * sizeof(uint64_t));
+    if (res == NULL) fail("malloc failed!\n");
+    return res;
+}
+
+// a random run of at most MAX_RUN blocks: its start and length
+static void random_run(unsigned long *b, unsigned long *len) {
+    *len= 1 + rnd_below(n_blk < MAX_RUN ? n_blk : MAX_RUN);
+    *b= rnd_below(n_blk - *len + 1);
+}
+
+static uint64_t *make_base(char *name) {
+    uint64_t *ids= new_blocks();
+    int fd= open_new(name);
+    if (pieces == 1) {
+        write_random(fd, 0, (off_t) (n_blk * blk));
+        for (unsigned long b= 0; b < n_blk; ++b)
+            ids[b]= n_ids + b;
+    } else { // from pieces of a scratch file, shuffled
+        int scratch= open_new(".scratch");
+        write_random(scratch, 0, (off_t) (n_blk * blk));
+        unsigned long n_p= pieces < n_blk ? pieces : n_blk;
+        unsigned long *order= malloc(n_p * sizeof(unsigned long));
+        if (order == NULL) fail("malloc failed!\n");
+        for (unsigned long i= 0; i < n_p; ++i)
+            order[i]= i;
+        for (unsigned long i= n_p - 1; i > 0; --i) {
+            unsigned long j= rnd_below(i + 1), t= order[i];
+            order[i]= order[j];
+            order[j]= t;
+        }
+        // piece i is blocks [i * n_blk / n_p, (i + 1) * n_blk / n_p) of the base; it comes from piece order[i]
+        unsigned long at= 0;
+        for (unsigned long i= 0; i < n_p; ++i) {
+            unsigned long from= order[i] * n_blk / n_p, len= (order[i] + 1) * n_blk / n_p - from;
+            clone_range(scratch, (off_t) (from * blk), fd, (off_t) (at * blk), (off_t) (len * blk));
+            for (unsigned long b= 0; b < len; ++b)
+                ids[at + b]= n_ids + from + b;
+            at += len;
+        }
+        free(order);
+        close(scratch);
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/.scratch", dir);
+        unlink(path);
+    }
+    n_ids += n_blk;
+    for (unsigned long k= 0; k < self; ++k) {
+        unsigned long src, dst, len;
+        random_run(&src, &len);
+        // a file's range can't be cloned onto an overlapping range of itself
+        unsigned tries= 0;
+        do dst= rnd_below(n_blk - len + 1);
+        while (dst + len > src && src + len > dst && ++tries < 100);
+        if (tries == 100) continue;
+        clone_range(fd, (off_t) (src * blk), fd, (off_t) (dst * blk), (off_t) (len * blk));
+        memmove(&ids[dst], &ids[src], len * sizeof(uint64_t));
+    }
+    close(fd);
+    return ids;
+}
+
+static uint64_t *make_clone(char *base_name, char *name, uint64_t *base_ids) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, base_name);
+    int src= open(path, O_RDONLY);
+    if (src < 0) fail("open of %s failed: %s\n", path, strerror(errno));
+    int fd= open_new(name);
+    if (ioctl(fd, FICLONE, src) < 0) fail("FICLONE failed: %s\n", strerror(errno));
+    close(src);
+    uint64_t *ids= new_blocks();
+    memcpy(ids, base_ids, n_blk * sizeof(uint64_t));
+    for (unsigned long k= 0; k < overwrites; ++k) {
+        unsigned long b, len;
+        random_run(&b, &len);
+        write_random(fd, (off_t) (b * blk), (off_t) (len * blk));
+        for (unsigned long i= 0; i < len; ++i)
+            ids[b + i]= n_ids++;
+    }
+    close(fd);
+    return ids;
+}
+
+// the manifest of a family of n files
+static void write_manifest(char names[][32], uint64_t **ids, unsigned long n) {
+    unsigned *uses= calloc(n_ids - fam_ids, sizeof(unsigned));
+    if (uses == NULL) fail("calloc failed!\n");
+    for (unsigned long f= 0; f < n; ++f)
+        for (unsigned long b= 0; b < n_blk; ++b)
+            uses[ids[f][b] - fam_ids]++;
+    for (unsigned long f= 0; f < n; ++f) {
+        unsigned long shared= 0;
+        for (unsigned long b= 0; b < n_blk; ++b)
+            if (uses[ids[f][b] - fam_ids] > 1) shared++;
+        fprintf(manifest, "file %s %lu %lu %lu\n", names[f], n_blk * blk, shared * blk, (n_blk - shared) * blk);
+        for (unsigned long b= 0, e; b < n_blk; b= e) {
+            for (e= b + 1; e < n_blk && ids[f][e] == ids[f][e - 1] + 1; ++e)
+                ;
+            fprintf(manifest, "%lu %lu %lu\n", b * blk, (e - b) * blk, (unsigned long) ids[f][b]);
+        }
+    }
+    free(uses);
+}
+
+int main(int argc, char *argv[]) {
+    args(argc, argv);
+    state= seed * 0x9E3779B97F4A7C15ULL + 1; // never 0
+    if (blk == 0) {
+        struct stat sb;
+        if (stat(dir, &sb) < 0) fail("Can't stat %s: %s\n", dir, strerror(errno));
+        blk= (unsigned long) sb.st_blksize;
+    }
+    n_blk= size / blk;
+    if (n_blk == 0) fail("SIZE must be at least one block (%lu)\n", blk);
+    manifest= stdout;
+    if (manifest_fn != NULL && (manifest= fopen(manifest_fn, "w")) == NULL)
+        fail("Can't open %s: %s\n", manifest_fn, strerror(errno));
+    fprintf(manifest, "# mkclones -s %lu -n %lu -d %lu -S %lu -b %lu -F %lu -w %lu -x %lu\n",
+            seed, n_files, degree, n_blk * blk, blk, pieces, overwrites, self);
+
+    char (*names)[32]= malloc(degree * sizeof(*names));
+    uint64_t **ids= malloc(degree * sizeof(uint64_t *));
+    if (names == NULL || ids == NULL) fail("malloc failed!\n");
+    for (unsigned long fam= 0, made= 0; made < n_files; ++fam) {
+        unsigned long n= n_files - made < degree ? n_files - made : degree;
+        fam_ids= n_ids;
+        for (unsigned long m= 0; m < n; ++m) {
+            snprintf(names[m], sizeof(names[m]), "f%03lu-%03lu", fam, m);
+            ids[m]= m == 0 ? make_base(names[0]) : make_clone(names[0], names[m], ids[0]);
+        }
+        write_manifest(names, ids, n);
+        for (unsigned long m= 0; m < n; ++m)
+            free(ids[m]);
+        made += n;
+    }
+    free(names);
+    free(ids);
+    if (manifest != stdout) fclose(manifest);
+    return 0;
+}
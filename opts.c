@@ -3,11 +3,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "opts.h"
 #include "fail.h"
 #include "print.h"
 #include "extents.h"
+#include "mem.h"
+#include "owners.h"
 
 bool
     print_flags        = false,
@@ -16,39 +20,189 @@ bool
     print_unshared_only= false,
     no_headers         = false,
     print_phys_addr    = false,
-    cmp_output         = false;
+    cmp_output         = false,
+    sync_extents       = false,
+    query_mode         = false,
+    coalesce           = false,
+    estimate_mode      = false,
+    delta_mode         = false,
+    apply_mode         = false,
+    delta_checksum     = true,
+    all_pairs          = false,
+    hugepages          = false,
+    frag_mode          = false,
+    clusters_mode      = false,
+    checksum_mode      = false,
+    stream_output      = false,
+    emit_shard         = false,
+    merge_mode         = false;
 
 off_t max_cmp= -1, skip1= 0, skip2= 0;
 
-#define USAGE "usage: %s -P [-f] [-n] [-p] FILE1 [FILE2 ...]\n"               \
-              "or:    %s [-s|-u] [-f] [-n] [-p] FILE1 [FILE2 ...]\n"          \
-	          "or:    %s -c [-b LIMIT] [-i SKIP1[:SKIP2]] [-v] FILE1 FILE2\n" \
+off_t frag_small= 1 << 20, cluster_edges= -1;
+
+unsigned max_retries= 5;
+
+unsigned jobs= 0, threads= 0; // 0 means one per processor
+
+unsigned shard_first= 0;
+
+double estimate_secs= 10;
+
+list *phys_ranges= NULL;
+
+char *daemon_socket= NULL;
+
+list *file_ranges= NULL;
+
+// long options without a short form
+enum { OPT_RETRIES= 256, OPT_PHYS, OPT_QUERY, OPT_DAEMON, OPT_COALESCE, OPT_ESTIMATE, OPT_DELTA, OPT_APPLY, OPT_NO_CHECKSUM, OPT_THREADS,
+       OPT_ALL_PAIRS, OPT_RANGE, OPT_HUGEPAGES, OPT_FRAG, OPT_CLUSTERS, OPT_CHECKSUM, OPT_STREAM,
+       OPT_EMIT_SHARD, OPT_MERGE };
+
+#define USAGE "usage: %s -P [-f] [-n] [-p] [-S] [-j N] FILE1 [FILE2 ...]\n"        \
+              "or:    %s [-s|-u] [-f] [-n] [-p] [-S] [-j N] [--stream] [--range [FILE:]OFF:LEN ...] FILE1 [FILE2 ...]\n" \
+	          "or:    %s -c [-b LIMIT] [-i SKIP1[:SKIP2]] [-S] [-v] FILE1 FILE2\n" \
+	          "or:    %s --all-pairs [-n] [-S] FILE1 FILE2 [FILE3 ...]\n" \
+	          "or:    %s --phys RANGE[,RANGE...] [-f] [-n] [-S] FILE1 [FILE2 ...]\n" \
+	          "or:    %s --query [-S] FILE1 [FILE2 ...]\n" \
+	          "or:    %s --daemon SOCKET FILE1 [FILE2 ...]\n" \
+	          "or:    %s --estimate[=SECONDS] [-n] [-S] FILE1 [FILE2 ...]\n" \
+	          "or:    %s --frag[=SMALL] [-n] [-S] [-j N] FILE1 [FILE2 ...]\n" \
+	          "or:    %s --clusters[=MIN_BYTES] [-n] [-S] [-j N] FILE1 [FILE2 ...]\n" \
+	          "or:    %s --checksum [-n] [-S] [-j N] FILE1 [FILE2 ...]\n" \
+	          "or:    %s --emit-shard[=FIRST_ID] [-S] [--range [FILE:]OFF:LEN ...] FILE1 [FILE2 ...] > SHARD\n" \
+	          "or:    %s --merge [OPTIONS] SHARD1 [SHARD2 ...]\n" \
+	          "or:    %s --delta [--no-checksum] [-S] BASE NEW > PATCH\n" \
+	          "or:    %s --apply BASE NEW < PATCH\n" \
 	          "or:    %s -h\n"
 
-static void usage(char *p) { fail(USAGE, p, p, p, p); }
+static void usage(char *p) { fail(USAGE, p, p, p, p, p, p, p, p, p, p, p, p, p, p, p, p); }
+
+// parse OFF[:LEN][,OFF[:LEN]...] onto the end of rs; LEN defaults to 1
+static void parse_ranges(char *arg, list *rs, char *opt) {
+    for (char *tok= strtok(arg, ","); tok != NULL; tok= strtok(NULL, ",")) {
+        range *r= malloc_s(sizeof(range));
+        int n= sscanf(tok, FIELD ":" FIELD, &r->off, &r->len);
+        if (n == 1) r->len= 1;
+        if (n < 1 || r->off < 0 || r->len <= 0)
+            fail("arg to %s must be OFFSET[:LENGTH][,...] (OFFSET non-negative, LENGTH positive)\n", opt);
+        append(rs, r);
+    }
+}
+
+// parse [FILE:]OFFSET:LENGTH onto the end of file_ranges (FILE may itself contain colons)
+static void parse_file_range(char *arg) {
+    file_range *fr= malloc_s(sizeof(file_range));
+    char *len= strrchr(arg, ':'), *off= NULL;
+    if (len != NULL) {
+        *len++= '\0';
+        off= strrchr(arg, ':');
+        if (off != NULL) *off++= '\0';
+        else off= arg;
+    }
+    fr->file= off == arg ? NULL : arg;
+    if (len == NULL || sscanf(off, FIELD, &fr->r.off) != 1 || sscanf(len, FIELD, &fr->r.len) != 1
+        || fr->r.off < 0 || fr->r.len <= 0)
+        fail("arg to --range must be [FILE:]OFFSET:LENGTH (OFFSET non-negative, LENGTH positive)\n");
+    ITER(file_ranges, file_range*, o, {
+        if (o->file == NULL ? fr->file == NULL : fr->file != NULL && strcmp(o->file, fr->file) == 0)
+            fail("Only one --range for %s\n", fr->file == NULL ? "all files" : fr->file);
+    })
+    append(file_ranges, fr);
+}
+
+// the window of file to analyse: its own --range, else the one for all files, else NULL (the whole file)
+range *range_of(char *file) {
+    range *res= NULL;
+    if (file_ranges != NULL)
+        ITER(file_ranges, file_range*, fr, {
+            if (fr->file == NULL) {
+                if (res == NULL) res= &fr->r;
+            } else if (strcmp(fr->file, file) == 0)
+                res= &fr->r;
+        })
+    return res;
+}
 
 static void print_help(char *progname) {
     printf("%s: Print extent information for files\n\n", progname);
-    printf(USAGE, progname, progname, progname, progname);
+    printf(USAGE, progname, progname, progname, progname, progname, progname, progname, progname, progname, progname,
+           progname, progname, progname, progname, progname, progname);
     printf("\nWith -P, prints information about each extent.\n");
     printf("With -c, prints indices of regions which may differ (used to drive ccmp).\n");
+    printf("With --phys, prints the extents (file, logical and physical offset) which map each range of the device.\n");
+    printf("With --query, determines sharing once and then answers queries from stdin, one per line (files numbered from 1):\n");
+    printf("  exclusive F [OFF [LEN]]  # of bytes in the range of FILE F which no other file maps\n");
+    printf("  shared F [OFF [LEN]]     # of bytes in the range which are shared\n");
+    printf("  sharers F [OFF [LEN]]    each shared piece of the range (OFF LEN) with the other files and offsets mapping it,\n");
+    printf("                           ending with an empty line\n");
+    printf("With --daemon, answers the same queries from clients of the Unix socket SOCKET, watching the files and\n");
+    printf("redetermining the sharing of any which change (which implies -S).\n");
+    printf("With --estimate, maps randomly sampled blocks of the files for at most SECONDS (default %g), and estimates\n", estimate_secs);
+    printf("the shared and exclusive bytes of each file, and in all, with 95%% confidence intervals; shared means shared\n");
+    printf("with anything, as the filesystem reports it, not just with the files given (Linux only).\n");
+    printf("With --frag, reports the fragmentation of each file: its # of extents, their mean and percentile lengths, the\n");
+    printf("physical distance jumped in reading it sequentially, the %% of its bytes in extents shorter than SMALL bytes\n");
+    printf("(default " FIELD "), and the # of jumps next to extents shared with other files; most fragmented first.\n", frag_small);
+    printf("With --clusters, groups the files into families connected by sharing, with the bytes each family maps (and\n");
+    printf("of those, the bytes mapped more than once), biggest first; with MIN_BYTES, also lists each pair of files\n");
+    printf("sharing at least MIN_BYTES bytes, with the bytes they share.\n");
+    printf("With --checksum, prints a checksum of the contents of each file, reading each extent only once however many\n");
+    printf("files share it.\n");
+    printf("With --emit-shard, maps the files and writes their extents to stdout as a shard, numbering the files from\n");
+    printf("FIRST_ID (default 0); with --merge, analyses the files of the SHARDs, numbered in that order, as if it had\n");
+    printf("mapped them itself (with -P, --phys, --query, --frag, --clusters, --stream or the sharing report).\n");
+    printf("With --delta, writes a patch holding only the regions of NEW which are not shared with BASE (a clone of it);\n");
+    printf("regions where NEW reads as zeros (holes and unwritten extents) are recorded without their data. With --apply,\n");
+    printf("rebuilds NEW from BASE and the patch, as a clone of BASE where the filesystem allows, punching the holes again.\n");
     printf("Otherwise, determines which extents are shared and prints information about shared and unshared extents.\n");
+    printf("With --stream, each region is printed as soon as it is found, in physical order, as a line of -n output\n");
+    printf("(whether shared or not), and then forgotten; output is flushed every 1024 regions or 0.1s.\n");
+    printf("Files on different devices (allowed only for this, -P, --frag, --clusters and --checksum) are analysed\n");
+    printf("separately, in parallel, and reported in a section per device, numbered within it.\n");
     printf("An extent is a contiguous area of physical storage and is described by:\n");
     printf("  n if it belongs to FILEn (omitted for only a single file);\n");
     printf("  the logical offset in the file at which it begins;\n");
     printf("  the physical offset on the underlying device at which it begins (if -p is specified);\n");
     printf("  its length.\nOffsets and lengths are in bytes.\n");
+    printf("A file which maps a shared extent at %d or more logical offsets in arithmetic progression has them printed\n", MIN_RUN);
+    printf("as START+STRIDExCOUNT.\n");
     printf("OS-specific flags are also printed (with -f). Flags are available only on Linux and are described in /usr/include/linux/fiemap.h.\n\n");
     printf("Options and their long forms:\n");
+    printf("   --all-pairs                     Output the regions to be compared (as by -c) for every pair of files\n");
     printf("-b --bytes LIMIT                   Compare at most LIMIT bytes (-c only)\n");
+    printf("   --coalesce                      Merge neighbouring extents, and regions, which are contiguous physically and\n");
+    printf("                                   logically and have the same flags (and owners); report the reduction on stderr\n");
+    printf("   --clusters[=MIN_BYTES]          Report the families of files sharing extents (and pairs sharing MIN_BYTES)\n");
+    printf("   --checksum                      Print a checksum of each file, reading shared extents once\n");
     printf("-c --cmp                           (two files only) Output unshared regions to be compared by ccmp. Fails silently unless -v follows.\n");
+    printf("   --daemon SOCKET                 Serve queries on SOCKET, keeping up with changes to the files (Linux only)\n");
+    printf("   --estimate[=SECONDS]            Estimate sharing from samples taken within SECONDS\n");
+    printf("   --delta                         Write a patch from BASE to NEW to stdout\n");
+    printf("   --apply                         Rebuild NEW from BASE and the patch on stdin\n");
+    printf("   --frag[=SMALL]                  Report each file's fragmentation, ranked\n");
+    printf("   --emit-shard[=FIRST_ID]         Write the files' extents to stdout, for --merge\n");
     printf("-f --flags                         Print OS-specific flags for each extent\n");
     printf("-h --help                          Print help (this message)\n");
+    printf("   --hugepages                     Back big arrays with huge pages (reserved ones if any, else transparent)\n");
     printf("-i --ignore-initial SKIP1[:SKIP2}  Skip first SKIP1 bytes of file1 (optionally, SKIP2 of file2) -- (-c)\n");
+    printf("-j --jobs N                        Analyse at most N devices at once (default: one per processor)\n");
+    printf("   --no-checksum                   Leave the checksums out of a patch (--delta)\n");
+    printf("   --merge                         Analyse the files of the shards given instead of files\n");
     printf("-n --no_headers                    Don't print human-readable headers and line numbers, output is easier to parse.\n");
     printf("-P --print_extents_only            Print extents for each file\n");
+    printf("   --query                         Answer queries about sharing from stdin\n");
     printf("-p --print_phys_addr               Print physical address of extents\n");
+    printf("   --phys OFF[:LEN][,OFF[:LEN]...] Look up which files map each physical range (LEN defaults to 1)\n");
+    printf("-S --sync                          Flush each file's dirty data before mapping it, and retry while its extents\n");
+    printf("                                   are unstable; files which never settle are left out (instead of a global sync)\n");
+    printf("   --range [FILE:]OFF:LEN          Analyse only LEN bytes from OFF of FILE (without FILE, of every file without a\n");
+    printf("                                   --range of its own); may be repeated\n");
+    printf("   --retries N                     With -S, remap an unstable file at most N times (default %d)\n", max_retries);
+    printf("   --stream                        Print each region as it is found, in physical order (implies -n)\n");
     printf("-s --print_shared_only             Print only shared extents\n");
+    printf("   --threads N                     Determine sharing with at most N threads (default: one per processor)\n");
     printf("-u --print_unshared_only           Print only unshared extents\n");
     printf("-v --dont_fail_silently            Don't fail silently (use only after -c)\n");
     printf("\nMario Wolczko, Oracle, Sep 2021\n");
@@ -69,8 +223,30 @@ void args(int argc, char *argv[])
             { "print_shared_only",    no_argument, NULL, 's' },
             { "print_unshared_only",  no_argument, NULL, 'u' },
             { "dont_fail_silently",   no_argument, NULL, 'v' },
+            { "sync",                 no_argument, NULL, 'S' },
+            { "jobs",           required_argument, NULL, 'j' },
+            { "retries",        required_argument, NULL, OPT_RETRIES },
+            { "phys",           required_argument, NULL, OPT_PHYS },
+            { "query",                no_argument, NULL, OPT_QUERY },
+            { "daemon",         required_argument, NULL, OPT_DAEMON },
+            { "coalesce",             no_argument, NULL, OPT_COALESCE },
+            { "estimate",       optional_argument, NULL, OPT_ESTIMATE },
+            { "delta",                no_argument, NULL, OPT_DELTA },
+            { "apply",                no_argument, NULL, OPT_APPLY },
+            { "no-checksum",          no_argument, NULL, OPT_NO_CHECKSUM },
+            { "threads",        required_argument, NULL, OPT_THREADS },
+            { "all-pairs",            no_argument, NULL, OPT_ALL_PAIRS },
+            { "range",          required_argument, NULL, OPT_RANGE },
+            { "hugepages",            no_argument, NULL, OPT_HUGEPAGES },
+            { "frag",           optional_argument, NULL, OPT_FRAG },
+            { "clusters",       optional_argument, NULL, OPT_CLUSTERS },
+            { "checksum",             no_argument, NULL, OPT_CHECKSUM },
+            { "stream",               no_argument, NULL, OPT_STREAM },
+            { "emit-shard",     optional_argument, NULL, OPT_EMIT_SHARD },
+            { "merge",                no_argument, NULL, OPT_MERGE },
+            { NULL,                             0, NULL, 0 }
     };
-    for (int c; c= getopt_long(argc, argv, "cfhnpPsuvb:i:", longopts, NULL), c != -1; ) {
+    for (int c; c= getopt_long(argc, argv, "cfhnpPSsuvb:i:j:", longopts, NULL), c != -1; ) {
         switch (c) {
             case 'b':
                 if (sscanf(optarg, FIELD, &max_cmp) != 1 || max_cmp <= 0)
@@ -92,6 +268,64 @@ void args(int argc, char *argv[])
             case 'n': no_headers=          true; break;
             case 'P': print_extents_only=  true; break;
             case 'p': print_phys_addr=     true; break;
+            case 'S': sync_extents=        true; break;
+            case 'j':
+                if (sscanf(optarg, "%u", &jobs) != 1 || jobs == 0)
+                    fail("arg to -j|--jobs must be a positive integer\n");
+                break;
+            case OPT_RETRIES:
+                if (sscanf(optarg, "%u", &max_retries) != 1)
+                    fail("arg to --retries must be a non-negative integer\n");
+                break;
+            case OPT_PHYS:
+                if (phys_ranges == NULL) phys_ranges= new_list(-4);
+                parse_ranges(optarg, phys_ranges, "--phys");
+                break;
+            case OPT_QUERY: query_mode= true; break;
+            case OPT_DAEMON:
+                daemon_socket= optarg;
+                sync_extents= true; // files will be remapped while they are being changed
+                break;
+            case OPT_COALESCE: coalesce= true; break;
+            case OPT_ESTIMATE:
+                estimate_mode= true;
+                if (optarg != NULL && (sscanf(optarg, "%lf", &estimate_secs) != 1 || estimate_secs <= 0))
+                    fail("arg to --estimate must be a positive number of seconds\n");
+                break;
+            case OPT_DELTA:
+                delta_mode= true;
+                sync_extents= true; // so that unwritten extents can be trusted to read as zeros
+                break;
+            case OPT_APPLY: apply_mode= true; break;
+            case OPT_NO_CHECKSUM: delta_checksum= false; break;
+            case OPT_ALL_PAIRS: all_pairs= true; break;
+            case OPT_HUGEPAGES: hugepages= true; break;
+            case OPT_CHECKSUM: checksum_mode= true; break;
+            case OPT_STREAM: stream_output= no_headers= true; break;
+            case OPT_MERGE: merge_mode= true; break;
+            case OPT_EMIT_SHARD:
+                emit_shard= true;
+                if (optarg != NULL && sscanf(optarg, "%u", &shard_first) != 1)
+                    fail("arg to --emit-shard must be a file ID\n");
+                break;
+            case OPT_CLUSTERS:
+                clusters_mode= true;
+                if (optarg != NULL && (sscanf(optarg, FIELD, &cluster_edges) != 1 || cluster_edges < 0))
+                    fail("arg to --clusters must be a non-negative number of bytes\n");
+                break;
+            case OPT_FRAG:
+                frag_mode= true;
+                if (optarg != NULL && (sscanf(optarg, FIELD, &frag_small) != 1 || frag_small <= 0))
+                    fail("arg to --frag must be a positive number of bytes\n");
+                break;
+            case OPT_RANGE:
+                if (file_ranges == NULL) file_ranges= new_list(-4);
+                parse_file_range(optarg);
+                break;
+            case OPT_THREADS:
+                if (sscanf(optarg, "%u", &threads) != 1 || threads == 0)
+                    fail("arg to --threads must be a positive integer\n");
+                break;
             case 's': print_shared_only=   true; break;
             case 'u': print_unshared_only= true; break;
             case 'v': fail_silently=      false; break;
@@ -99,6 +333,9 @@ void args(int argc, char *argv[])
             default : usage(argv[0]);
         }
     }
+    long n_cpus= sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs == 0) jobs= n_cpus > 0 ? (unsigned) n_cpus : 1;
+    if (threads == 0) threads= n_cpus > 0 ? (unsigned) n_cpus : 1;
     nfiles= (unsigned)(argc - optind);
     if (nfiles < 1) usage(argv[0]);
     if (print_shared_only && print_unshared_only)
@@ -109,4 +346,58 @@ void args(int argc, char *argv[])
         fail("Choose at most one of -c and -P\n");
     if (cmp_output && (print_shared_only || print_unshared_only || print_phys_addr))
         fail("Can't use -c with -s, -u or -p\n");
+    if (phys_ranges != NULL && (cmp_output || print_extents_only || print_shared_only || print_unshared_only))
+        fail("Can't use --phys with -c, -P, -s or -u\n");
+    if (query_mode && (cmp_output || print_extents_only || phys_ranges != NULL))
+        fail("Can't use --query with -c, -P or --phys\n");
+    if (daemon_socket != NULL && (cmp_output || print_extents_only || phys_ranges != NULL || query_mode))
+        fail("Can't use --daemon with -c, -P, --phys or --query\n");
+    if ((delta_mode || apply_mode) && nfiles != 2)
+        fail("Must have two files, BASE and NEW, with --delta or --apply\n");
+    bool other_mode= cmp_output || print_extents_only || phys_ranges != NULL || query_mode || daemon_socket != NULL
+                     || estimate_mode || frag_mode || clusters_mode || checksum_mode;
+    if ((delta_mode || apply_mode) && (other_mode || (delta_mode && apply_mode) || skip1 > 0 || skip2 > 0 || max_cmp > 0))
+        fail("Can't use --delta or --apply with each other, or with -b, -c, -i, -P, --phys, --query, --daemon or --estimate\n");
+    if (all_pairs && nfiles < 2)
+        fail("Must have at least two files with --all-pairs\n");
+    if (all_pairs && (other_mode || delta_mode || apply_mode || print_shared_only || print_unshared_only
+                      || print_phys_addr || print_flags || coalesce || skip1 > 0 || skip2 > 0 || max_cmp > 0))
+        fail("Can't use --all-pairs with -b, -c, -f, -i, -P, -p, -s, -u, --phys, --query, --daemon, --estimate, "
+             "--delta, --apply or --coalesce\n");
+    if (file_ranges != NULL && (other_mode || delta_mode || apply_mode || all_pairs))
+        fail("--range is only for the sharing report\n");
+    if (file_ranges != NULL)
+        ITER(file_ranges, file_range*, fr, {
+            bool found= fr->file == NULL;
+            for (int i= optind; i < argc && !found; ++i)
+                found= strcmp(argv[i], fr->file) == 0;
+            if (!found) fail("--range: %s is not one of the files\n", fr->file);
+        })
+    if (frag_mode && (cmp_output || print_extents_only || phys_ranges != NULL || query_mode || daemon_socket != NULL
+                      || estimate_mode || all_pairs || print_shared_only || print_unshared_only || print_phys_addr
+                      || print_flags || coalesce))
+        fail("Can't use --frag with -c, -f, -P, -p, -s, -u, --phys, --query, --daemon, --estimate, --all-pairs or "
+             "--coalesce\n");
+    if (clusters_mode && (cmp_output || print_extents_only || phys_ranges != NULL || query_mode || daemon_socket != NULL
+                          || estimate_mode || all_pairs || frag_mode || print_shared_only || print_unshared_only
+                          || print_phys_addr || print_flags))
+        fail("Can't use --clusters with -c, -f, -P, -p, -s, -u, --phys, --query, --daemon, --estimate, --all-pairs or "
+             "--frag\n");
+    if (checksum_mode && (cmp_output || print_extents_only || phys_ranges != NULL || query_mode || daemon_socket != NULL
+                          || estimate_mode || all_pairs || frag_mode || clusters_mode || print_shared_only
+                          || print_unshared_only || print_phys_addr || print_flags))
+        fail("Can't use --checksum with -c, -f, -P, -p, -s, -u, --phys, --query, --daemon, --estimate, --all-pairs, "
+             "--frag or --clusters\n");
+    if (stream_output && (other_mode || delta_mode || apply_mode || all_pairs || coalesce))
+        fail("--stream is only for the sharing report, without --coalesce\n");
+    if (emit_shard && (other_mode || delta_mode || apply_mode || all_pairs || stream_output || merge_mode || no_headers
+                       || print_shared_only || print_unshared_only || print_phys_addr || print_flags))
+        fail("Can't use --emit-shard with -c, -f, -n, -P, -p, -s, -u, --phys, --query, --daemon, --estimate, --frag, "
+             "--clusters, --checksum, --all-pairs, --delta, --apply, --stream or --merge\n");
+    if (merge_mode && (cmp_output || daemon_socket != NULL || estimate_mode || checksum_mode || all_pairs || delta_mode
+                       || apply_mode || file_ranges != NULL))
+        fail("Can't use --merge with -c, --daemon, --estimate, --checksum, --all-pairs, --delta, --apply or --range\n");
+    if (estimate_mode && (cmp_output || print_extents_only || phys_ranges != NULL || query_mode || daemon_socket != NULL
+                          || print_shared_only || print_unshared_only || coalesce))
+        fail("Can't use --estimate with -c, -P, -s, -u, --phys, --query, --daemon or --coalesce\n");
 }
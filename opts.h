@@ -4,6 +4,14 @@
 #define EXTENTS_OPTS_H
 
 #include <stdbool.h>
+#include <sys/types.h>
+
+#include "lists.h"
+
+typedef struct range range;
+struct range {
+    off_t off, len;
+};
 
 extern bool
         print_flags,
@@ -12,10 +20,53 @@ extern bool
         print_unshared_only,
         no_headers,
         print_phys_addr,
-        cmp_output;
+        cmp_output,
+        sync_extents,
+        query_mode,
+        coalesce,
+        estimate_mode,
+        delta_mode,
+        apply_mode,
+        delta_checksum,
+        all_pairs,
+        hugepages,
+        frag_mode,
+        clusters_mode,
+        checksum_mode,
+        stream_output,
+        emit_shard,
+        merge_mode;
+
+// the window of a file (or, if file is NULL, of every file) to analyse, with --range
+typedef struct file_range file_range;
+struct file_range {
+    char *file;
+    range r;
+};
 
 extern off_t max_cmp, skip1, skip2;
 
+extern off_t frag_small; // extents shorter than this are small, for --frag
+
+extern off_t cluster_edges; // list the pairs of files sharing at least this many bytes, for --clusters; -1: none
+
+extern unsigned max_retries;
+
+extern unsigned jobs;    // # of devices to analyse at once
+extern unsigned threads; // # of threads to determine sharing with
+
+extern unsigned shard_first; // global ID of the first file, for --emit-shard
+
+extern double estimate_secs; // time budget for --estimate
+
+extern list *phys_ranges; // range*s to look up with --phys, or NULL
+
+extern char *daemon_socket; // path of socket for --daemon, or NULL
+
+extern list *file_ranges; // file_range*s from --range, or NULL
+
+extern range *range_of(char *file);
+
 extern void args(int argc, char *argv[]);
 
 #endif //EXTENTS_OPTS_H
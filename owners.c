@@ -0,0 +1,93 @@
+/*
+ * Interning of owner sets
+ *
+ * When a golden image has thousands of clones most regions have exactly the same owning files, so each distinct set
+ * of owners is stored once, in a hash table, and shared by every region it owns.  A file which clones a block over
+ * itself N times owns the region N times over, but as a single run.  Sweeps running in parallel share the table, but
+ * each first looks in a small cache of its own of the sets it last found, so that the lock on the table is taken only
+ * when the owners change to a set the thread hasn't met lately.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "owners.h"
+
+static ownerset **table; // hash chains
+static unsigned n_buckets= 0, n_sets= 0;
+static pthread_mutex_t lock= PTHREAD_MUTEX_INITIALIZER;
+
+#define CACHE_SZ 256 // sets, per thread; a power of 2
+static __thread ownerset *cache[CACHE_SZ]; // by hash; sets are never freed, so an entry stays valid
+
+static unsigned hash_owners(owner *os, unsigned n) {
+    uint32_t h= 2166136261u; // FNV-1a
+    for (unsigned i= 0; i < n; ++i) {
+        h= (h ^ os[i].file) * 16777619u;
+        h= (h ^ os[i].flags) * 16777619u;
+        h= (h ^ os[i].count) * 16777619u;
+    }
+    return h;
+}
+
+static void grow() {
+    unsigned n= n_buckets == 0 ? 1024 : 2 * n_buckets;
+    ownerset **t= calloc_s(n, sizeof(ownerset *));
+    for (unsigned b= 0; b < n_buckets; ++b)
+        for (ownerset *s= table[b], *nxt; s != NULL; s= nxt) {
+            nxt= s->next;
+            s->next= t[s->hash & (n - 1)];
+            t[s->hash & (n - 1)]= s;
+        }
+    free(table);
+    table= t;
+    n_buckets= n;
+}
+
+static bool is_set(ownerset *s, unsigned h, owner *os, unsigned n) {
+    return s->hash == h && s->n == n && memcmp(s->o, os, n * sizeof(owner)) == 0;
+}
+
+// the set of the n runs os, which must be in order of file; fills in their stride_ix
+ownerset *intern_owners(owner *os, unsigned n) {
+    unsigned n_strided= 0, n_owners= 0;
+    for (unsigned i= 0; i < n; ++i) {
+        os[i].stride_ix= os[i].count > 1 ? n_strided++ : 0;
+        n_owners += os[i].count;
+    }
+    unsigned h= hash_owners(os, n);
+    ownerset **c= &cache[h & (CACHE_SZ - 1)];
+    if (*c != NULL && is_set(*c, h, os, n)) return *c;
+    pthread_mutex_lock(&lock);
+    if (n_buckets > 0)
+        for (ownerset *s= table[h & (n_buckets - 1)]; s != NULL; s= s->next)
+            if (is_set(s, h, os, n)) {
+                pthread_mutex_unlock(&lock);
+                return *c= s;
+            }
+    if (n_sets >= n_buckets) grow();
+    ownerset *s= malloc_s(sizeof(ownerset) + n * sizeof(owner));
+    s->hash= h;
+    s->n= n;
+    s->n_owners= n_owners;
+    s->n_strided= n_strided;
+    memcpy(s->o, os, n * sizeof(owner));
+    s->self_shared= false;
+    s->bytes= 0;
+    for (unsigned i= 0; i < n; ++i)
+        if (os[i].count > 1 || (i > 0 && os[i].file == os[i - 1].file))
+            s->self_shared= true;
+    s->next= table[h & (n_buckets - 1)];
+    table[h & (n_buckets - 1)]= s;
+    n_sets++;
+    pthread_mutex_unlock(&lock);
+    return *c= s;
+}
+
+void for_each_ownerset(void (*fn)(ownerset *s)) {
+    for (unsigned b= 0; b < n_buckets; ++b)
+        for (ownerset *s= table[b]; s != NULL; s= s->next)
+            fn(s);
+}
@@ -0,0 +1,41 @@
+// Interned sets of the owners of regions
+
+#ifndef EXTENTS_OWNERS_H
+#define EXTENTS_OWNERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A run of owners: count owners from one file, with the same flags, mapping a region at logical offsets which form
+// an arithmetic progression (a file cloning a block many times over itself makes long runs).
+typedef struct owner owner;
+struct owner {
+    uint32_t file;      // argno of the owning file
+    unsigned flags;     // of the owners' extents
+    unsigned count;     // # of owners in the run
+    unsigned stride_ix; // if count > 1, index of the run's stride among those of the strided runs
+};
+
+// The owners of a region, as runs in order of file (a file owning the region at several logical offsets has a run or
+// runs for them, in logical order).  Sets are hash-consed: regions with the same owners share one set, so sets can be
+// compared by address.
+typedef struct ownerset ownerset;
+struct ownerset {
+    ownerset *next;     // in hash chain
+    unsigned hash;
+    unsigned n;         // # of runs
+    unsigned n_owners;  // # of owners in all the runs
+    unsigned n_strided; // # of runs with count > 1
+    bool self_shared;   // some file appears more than once
+    off_t bytes;        // tallied by --clusters: physical bytes of the regions with these owners
+    owner o[];
+};
+
+extern ownerset *intern_owners(owner *os, unsigned n);
+
+extern void for_each_ownerset(void (*fn)(ownerset *s));
+
+#define MIN_RUN 3 // shorter progressions are left as single owners
+
+#endif //EXTENTS_OWNERS_H
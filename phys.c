@@ -0,0 +1,85 @@
+/*
+ * Reverse physical lookup (--phys)
+ *
+ * Extents sorted by physical offset can still overlap one another (that is what sharing is), so a binary search on
+ * the start alone won't find every extent covering a range.  Alongside the sorted extents the index keeps the running
+ * maximum of their physical ends, which is monotonic: binary search on it gives the first extent which can reach the
+ * range, and the scan stops at the first extent starting beyond it.  Each query costs O(log n + k) for k extents found
+ * (plus any short extents lying wholly inside a longer one which precedes the range).
+ *
+ * Extents with unexpected flags (not yet allocated, or of inline data) have no physical offset that can be trusted, so
+ * are left out, and counted on stderr.  Unwritten extents are allocated, so are kept.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "extents.h"
+#include "fiemap.h"
+#include "lists.h"
+#include "mem.h"
+#include "opts.h"
+#include "phys.h"
+#include "print.h"
+#include "sorting.h"
+
+phys_index *new_phys_index(list *exts) {
+    phys_index *pi= malloc_s(sizeof(phys_index));
+    pi->exts= exts;
+    pi->reach= NULL;
+    update_reach(pi, 0);
+    return pi;
+}
+
+void update_reach(phys_index *pi, size_t from) {
+    size_t n= n_elems(pi->exts);
+    pi->reach= realloc_s(pi->reach, max(n, 1) * sizeof(off_t));
+    off_t reach= from > 0 ? pi->reach[from - 1] : 0;
+    for (size_t i= from; i < n; ++i) {
+        extent *e= get(pi->exts, i);
+        reach= max(reach, e->p + e->len);
+        pi->reach[i]= reach;
+    }
+}
+
+size_t first_reaching(phys_index *pi, off_t p) {
+    size_t lo= 0, hi= n_elems(pi->exts);
+    while (lo < hi) {
+        size_t mid= lo + (hi - lo) / 2;
+        if (pi->reach[mid] > p) hi= mid;
+        else lo= mid + 1;
+    }
+    return lo;
+}
+
+phys_index *new_placed_index() {
+    phys_sort_extents();
+    list *placed= new_list(-(ssize_t) max(n_ext, 1));
+    unsigned *left_out= calloc_s(nfiles, sizeof(unsigned));
+    ITER(extents, extent*, e, {
+        if (flags_are_sane(e->flags) || reads_as_zeros(e->flags)) append(placed, e);
+        else left_out[e->info->argno]++;
+    })
+    for (unsigned i= 0; i < nfiles; ++i)
+        if (left_out[i] > 0)
+            fprintf(stderr, "%s: %u extent%s with unexpected flags left out\n", info[i].name, left_out[i],
+                    left_out[i] == 1 ? "" : "s");
+    free(left_out);
+    return new_phys_index(placed);
+}
+
+void answer_phys_queries() {
+    phys_index *pi= new_placed_index();
+    if (!no_headers) print_file_key();
+    ITER(phys_ranges, range*, r, {
+        print_phys_range_header(r);
+        unsigned n= 0;
+        ITER_OVERLAPPING(pi, r->off, r->len, e, {
+            off_t from= max(r->off, e->p);
+            off_t to= min(r->off + r->len, e->p + e->len);
+            print_phys_match(++n, r, e, from, to - from);
+        })
+        if (n == 0) print_phys_no_match();
+        if (!no_headers) putchar('\n');
+    })
+}
@@ -0,0 +1,41 @@
+// Reverse physical lookup: from ranges of the device to the files and logical offsets mapping them
+
+#ifndef EXTENTS_PHYS_H
+#define EXTENTS_PHYS_H
+
+#include <sys/types.h>
+
+#include "extents.h"
+#include "lists.h"
+
+typedef struct phys_index phys_index;
+struct phys_index {
+    list *exts;   // extent*, sorted by physical offset
+    off_t *reach; // reach[i] is the furthest physical end of exts[0..i]
+};
+
+// exts must already be sorted by physical offset
+extern phys_index *new_phys_index(list *exts);
+
+// bring the index up to date after its extents from index from on have changed (in number, too)
+extern void update_reach(phys_index *pi, size_t from);
+
+// the index of all the extents whose physical offsets can be trusted; the others are counted on stderr
+extern phys_index *new_placed_index();
+
+// index of the first extent which may overlap physical offset p or beyond
+extern size_t first_reaching(phys_index *pi, off_t p);
+
+// iterate over the extents overlapping the physical range [off, off+sz)
+#define ITER_OVERLAPPING(pi, off, sz, e, stmt) {                          \
+  phys_index *_pi= (pi);                                                  \
+  off_t _p= (off), _end= _p + (sz);                                       \
+  for (size_t _i= first_reaching(_pi, _p); _i < n_elems(_pi->exts); ++_i) { \
+    extent *(e)= get(_pi->exts, _i);                                      \
+    if ((e)->p >= _end) break;                                            \
+    if ((e)->p + (e)->len > _p) do { stmt; } while (0);                   \
+  }}
+
+extern void answer_phys_queries();
+
+#endif //EXTENTS_PHYS_H
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <inttypes.h>
 
 #include "extents.h"
 #include "fiemap.h"
@@ -11,6 +12,7 @@
 #include "print.h"
 #include "sharing.h"
 #include "sorting.h"
+#include "coalesce.h"
 
 #define LINENO_FMT "%-6"
 #define FIELD_WIDTH 15
@@ -50,11 +52,21 @@ static void print_extent(extent *e) {
     print_off_t(e->len);
 }
 
-static void print_sh_ext(off_t p, off_t len, extent *owner) {
-    off_t l= p - owner->p + owner->l;
-    print_off_t(l);
-    if (print_phys_addr) print_off_t(p);
-    print_off_t(len);
+static void print_sh_ext(sh_ext *s, unsigned r) {
+    print_off_t(run_l(s, r));
+    if (print_phys_addr) print_off_t(s->p);
+    print_off_t(s->len);
+}
+
+// the logical offsets of a run of owners: START, or START+STRIDExCOUNT
+static void print_run(sh_ext *s, unsigned r) {
+    if (run_count(s, r) == 1) {
+        print_off_t(run_l(s, r));
+        return;
+    }
+    char buf[64];
+    sprintf(buf, FIELD "+" FIELD "x%u", run_l(s, r), run_stride(s, r), run_count(s, r));
+    printf(no_headers ? "%s " : STRING_FIELD_FMT " ", buf);
 }
 
 static unsigned hdr_line;
@@ -105,26 +117,27 @@ void print_extents_by_file() {
     }
 }
 
+// a region on a line of its own, without headers: its length, physical offset (with -p), then the file # and logical
+// offsets of each run of owners; with -f, their flags on the next line
+void print_region(sh_ext *s_e) {
+    print_off_t(s_e->len);
+    if (print_phys_addr) print_off_t(s_e->p);
+    for (unsigned r= 0; r < n_runs(s_e); ++r) {
+        printf("%d ", run_file(s_e, r) + 1);
+        print_run(s_e, r);
+    }
+    putchar('\n');
+    if (print_flags) {
+        for (unsigned r= 0; r < n_runs(s_e); ++r) {
+            if (r > 0) { putchar(','); putchar(' '); }
+            fputs(flag_pr(run_flags(s_e, r), true), stdout);
+        }
+        putchar('\n');
+    }
+}
+
 void print_shared_extents_no_header() {
-    ITER(shared, sh_ext*, s_e, {
-	    print_off_t(s_e->len);
-	    if (print_phys_addr) print_off_t(s_e->p);
-	    ITER(s_e->owners, extent*, owner, {
-	        printf("%d ", owner->info->argno + 1);
-	        print_off_t(s_e->p - owner->p + owner->l);
-	    })
-	    putchar('\n');
-	    if (print_flags) {
-	        bool first= true;
-	        ITER(s_e->owners, extent*, owner, {
-		        char *f= flag_pr(owner->flags, true);
-		        if (!first) { putchar(','); putchar(' '); }
-		        fputs(f, stdout);
-		        first= false;
-	        })
-	        putchar('\n');
-	    }
-    })
+    ITER(shared, sh_ext*, s_e, print_region(s_e))
 }
 
 void print_shared_extents() {
@@ -151,15 +164,15 @@ void print_shared_extents() {
     }
     unsigned e= 1;
     ITER(shared, sh_ext*, s_e, {
-        if (!s_e->self_shared) {
+        if (!s_e->owners->self_shared) {
             if (!no_headers) print_lineno(e++);
             print_off_t(s_e->len);
             if (print_phys_addr) print_off_t(s_e->p);
             sep();
             for (unsigned i= 0; i < nfiles; ++i) {
-                extent *owner= find_owner(s_e, i);
-                if (owner != NULL)
-                    print_off_t(s_e->p - owner->p + owner->l);
+                int r= find_run(s_e, i);
+                if (r >= 0)
+                    print_off_t(run_l(s_e, r));
                 else
                     print_off_t_s(no_headers ? "- " : "");
                 if (i < nfiles - 1) sep();
@@ -172,8 +185,8 @@ void print_shared_extents() {
                 sep();
                 bool first= true;
                 for (unsigned i= 0; i < nfiles; ++i) {
-                    extent *owner= find_owner(s_e, i);
-                    char *f= owner == NULL ? "" : flag_pr(owner->flags, true);
+                    int r= find_run(s_e, i);
+                    char *f= r < 0 ? "" : flag_pr(run_flags(s_e, r), true);
                     if (no_headers) {
                         if (!first) {
                             putchar(',');
@@ -209,15 +222,15 @@ void print_self_shared_extents() {
     }
     unsigned e= 1;
     ITER(shared, sh_ext*, s_e, {
-        if (s_e->self_shared) {
+        if (s_e->owners->self_shared) {
             if (!no_headers) print_lineno(e++);
             print_off_t(s_e->len);
             if (print_phys_addr) print_off_t(s_e->p);
             sep();
-            ITER(s_e->owners, extent * , owner, {
-                print_fileno(owner->info->argno + 1);
-                print_off_t(s_e->p - owner->p + owner->l);
-            })
+            for (unsigned r= 0; r < n_runs(s_e); ++r) {
+                print_fileno(run_file(s_e, r) + 1);
+                print_run(s_e, r);
+            }
             putchar('\n');
             if (print_flags) {
                 if (!no_headers) {
@@ -226,18 +239,16 @@ void print_self_shared_extents() {
                     if (print_phys_addr) print_off_t_s("");
                     sep();
                 }
-                bool first= true;
-                ITER(s_e->owners, extent * , owner, {
-                    char *f= flag_pr(owner->flags, true);
+                for (unsigned r= 0; r < n_runs(s_e); ++r) {
+                    char *f= flag_pr(run_flags(s_e, r), true);
                     if (no_headers) {
-                        if (!first) { putchar(','); putchar(' '); }
+                        if (r > 0) { putchar(','); putchar(' '); }
                         fputs(f, stdout);
-                        first= false;
                     } else {
                         printf("%-*s", FILENO_WIDTH + FIELD_WIDTH, f);
-                        if (owner != last(s_e->owners)) sep();
+                        if (r < n_runs(s_e) - 1) sep();
                     }
-                })
+                }
                 putchar('\n');
             }
         }
@@ -255,17 +266,43 @@ void print_unshared_extents() {
             unsigned n= 1;
             ITER(unsh, sh_ext*, sh, {
                 if (!no_headers) print_lineno(n++);
-                extent *owner= only(sh->owners);
-                print_sh_ext(sh->p, sh->len, owner);
-                if (print_flags) { sep(); fputs(flag_pr(owner->flags, true), stdout); }
+                print_sh_ext(sh, 0);
+                if (print_flags) { sep(); fputs(flag_pr(run_flags(sh, 0), true), stdout); }
                 putchar('\n');
             })
         }
     }
 }
 
-void print_cmp(off_t start, off_t len) {
-    printf(FIELD " " FIELD " " FIELD "\n", start + skip1, start + skip2, len);
+// a region known to be zeros in one file has a 4th field, Z1 or Z2
+void print_cmp(off_t start, off_t len, region_kind kind) {
+    printf(FIELD " " FIELD " " FIELD "%s\n", start + skip1, start + skip2, len,
+           kind == ZERO_1 ? " Z1" : kind == ZERO_2 ? " Z2" : "");
+    fflush(stdout); // ccmp consumes regions as they appear
+}
+
+static unsigned pair_line; // # of regions printed for the current pair
+
+void print_pair_header(unsigned a, unsigned b) {
+    printf("Files %d and %d:\n", a + 1, b + 1);
+    for (hdr_line= 1; hdr_line <= 2; hdr_line++) {
+        print_lineno_s(h("", "#", ""));
+        print_off_t_s(h("", "Logical", "Offset"));
+        print_off_t_s(h("", "Length", ""));
+        fputs(h("", "Zeros", ""), stdout);
+        putchar('\n');
+    }
+    pair_line= 0;
+}
+
+// with no headers, each line begins with the numbers of the pair of files
+void print_pair_cmp(unsigned a, unsigned b, off_t start, off_t len, region_kind kind) {
+    if (no_headers) printf("%d %d ", a + 1, b + 1);
+    else print_lineno(++pair_line);
+    print_off_t(start);
+    print_off_t(len);
+    if (kind != MAY_DIFFER) fputs(kind == ZERO_1 ? "Z1" : "Z2", stdout);
+    putchar('\n');
 }
 
 void print_file_key() {
@@ -274,13 +311,189 @@ void print_file_key() {
     putchar('\n');
 }
 
-void debug_print_extents(unsigned ei, extent *cur, list *owners) {
+void print_phys_range_header(range *r) {
+    if (no_headers) return;
+    printf("Physical " FIELD ".." FIELD ":\n", r->off, r->off + r->len - 1);
+    for (hdr_line= 1; hdr_line <= 2; hdr_line++) {
+        print_lineno_s(h("", "#", ""));
+        print_fileno_header(h("", "File#", ""));
+        print_off_t_s(h("", "Logical", "Offset"));
+        print_off_t_s(h("", "Physical", "Offset"));
+        print_off_t_s(h("", "Length", ""));
+        if (print_flags) fputs(h("", "  Flags", ""), stdout);
+        putchar('\n');
+    }
+}
+
+// with no headers, each line begins with the range queried
+void print_phys_match(unsigned n, range *r, extent *e, off_t p, off_t len) {
+    if (no_headers) {
+        print_off_t(r->off);
+        print_off_t(r->len);
+    } else
+        print_lineno(n);
+    print_fileno(e->info->argno + 1);
+    print_off_t(e->l + (p - e->p));
+    print_off_t(p);
+    print_off_t(len);
+    if (print_flags) printf(" %s", flag_pr(e->flags, false));
+    putchar('\n');
+}
+
+void print_phys_no_match() {
+    if (!no_headers) puts("No extents");
+}
+
+// of every file, or of only those which were left out
+void print_stability_report(bool all) {
+    for (unsigned i= 0; i < nfiles; ++i) {
+        fileinfo *fi= &info[i];
+        if (!all && fi->stable) continue;
+        fprintf(stderr, "%s: %s after %d attempt%s%s\n", fi->name, fi->stable ? "stable" : "unstable",
+                fi->attempts, fi->attempts == 1 ? "" : "s", fi->stable ? "" : "; left out");
+    }
+}
+
+void print_coalesce_report() {
+    fprintf(stderr, "coalesced %lu extents into %lu\n", exts_before, exts_after);
+    if (regions_before > 0)
+        fprintf(stderr, "coalesced %lu regions into %lu\n", regions_before, regions_after);
+}
+
+void print_estimate_header(unsigned long samples, unsigned long holes, double secs) {
+    if (no_headers) return;
+    print_file_key();
+    printf("Estimated from %lu samples (%lu in holes) in %.1fs; 95%% confidence intervals\n", samples, holes, secs);
+    for (hdr_line= 1; hdr_line <= 2; hdr_line++) {
+        print_fileno_header(h("", "File#", ""));
+        print_off_t_s(h("", "Samples", ""));
+        print_off_t_s(h("", "Shared", "bytes"));
+        print_off_t_s(h("", "", "low"));
+        print_off_t_s(h("", "", "high"));
+        sep();
+        print_off_t_s(h("", "Exclusive", "bytes"));
+        print_off_t_s(h("", "", "low"));
+        print_off_t_s(h("", "", "high"));
+        putchar('\n');
+    }
+}
+
+void print_frag_header() {
+    if (no_headers) return;
+    print_file_key();
+    printf("Ranked by distance jumped reading sequentially; small extents are shorter than " FIELD " bytes\n", frag_small);
+    for (hdr_line= 1; hdr_line <= 2; hdr_line++) {
+        print_lineno_s(h("", "#", ""));
+        print_fileno_header(h("", "File#", ""));
+        print_off_t_s(h("", "Extents", ""));
+        print_off_t_s(h("", "Mean", "length"));
+        print_off_t_s(h("", "Median", "length"));
+        print_off_t_s(h("", "90th %ile", "length"));
+        print_off_t_s(h("", "99th %ile", "length"));
+        print_off_t_s(h("", "Seek", "distance"));
+        print_off_t_s(h("", "Bytes in", "small (%)"));
+        print_off_t_s(h("", "Jumps at", "shared"));
+        putchar('\n');
+    }
+}
+
+void print_frag(unsigned rank, frag *f) {
+    if (!no_headers) print_lineno(rank);
+    print_fileno(f->file + 1);
+    print_off_t(f->n_exts);
+    print_off_t(f->mean); print_off_t(f->p50); print_off_t(f->p90); print_off_t(f->p99);
+    print_off_t(f->seek);
+    printf(no_headers ? "%.1f " : "%" FIELD_WIDTH_S ".1f ", f->small);
+    print_off_t(f->shared_breaks);
+    putchar('\n');
+}
+
+void print_clusters_header() {
+    if (no_headers) return;
+    print_file_key();
+    puts("Clusters:");
+    for (hdr_line= 1; hdr_line <= 2; hdr_line++) {
+        print_lineno_s(h("", "#", ""));
+        print_fileno_header(h("", "Files", ""));
+        print_off_t_s(h("", "Total", "bytes"));
+        print_off_t_s(h("", "Shared", "bytes"));
+        sep();
+        fputs(h("", "File#s", ""), stdout);
+        putchar('\n');
+    }
+}
+
+void print_cluster(unsigned n, unsigned *files, unsigned n_files, off_t total, off_t shared) {
+    if (!no_headers) print_lineno(n);
+    print_fileno(n_files);
+    print_off_t(total);
+    print_off_t(shared);
+    sep();
+    for (unsigned i= 0; i < n_files; ++i)
+        printf(i + 1 < n_files ? "%d " : "%d", files[i] + 1);
+    putchar('\n');
+}
+
+// with no headers, the edges follow the clusters after an empty line
+void print_edges_header() {
+    putchar('\n');
+    if (no_headers) return;
+    printf("Pairs of files sharing at least " FIELD " bytes:\n", cluster_edges);
+    for (hdr_line= 1; hdr_line <= 2; hdr_line++) {
+        print_fileno_header(h("", "File#", ""));
+        print_fileno_header(h("", "File#", ""));
+        print_off_t_s(h("", "Shared", "bytes"));
+        putchar('\n');
+    }
+}
+
+void print_edge(unsigned a, unsigned b, off_t bytes) {
+    print_fileno(a + 1);
+    print_fileno(b + 1);
+    print_off_t(bytes);
+    putchar('\n');
+}
+
+void print_checksums_header(off_t bytes_read, off_t total) {
+    if (no_headers) return;
+    print_file_key();
+    printf("Read " FIELD " bytes for " FIELD " bytes of files\n", bytes_read, total);
+    for (hdr_line= 1; hdr_line <= 2; hdr_line++) {
+        print_fileno_header(h("", "File#", ""));
+        print_off_t_s(h("", "Size", ""));
+        sep();
+        fputs(h("", "Checksum", ""), stdout);
+        putchar('\n');
+    }
+}
+
+// d is NULL for a file left out
+void print_checksum(unsigned file, off_t size, digest *d) {
+    print_fileno(file + 1);
+    print_off_t(size);
+    sep();
+    if (d != NULL) printf("%016" PRIx64 "%016" PRIx64 "\n", d->h[0], d->h[1]);
+    else puts("-");
+}
+
+// file n, or the totals if n is 0
+void print_estimate(unsigned n, unsigned long samples, estimate sh, estimate ex) {
+    if (n > 0 || no_headers) print_fileno(n);
+    else print_fileno_header("All");
+    print_off_t((off_t) samples);
+    print_off_t(sh.est); print_off_t(sh.lo); print_off_t(sh.hi);
+    sep();
+    print_off_t(ex.est); print_off_t(ex.lo); print_off_t(ex.hi);
+    putchar('\n');
+}
+
+void debug_print_extents(size_t ei, extent *cur, list *owners) {
     putchar('{');
     if (owners != NULL) ITER(owners, extent*, owner, printf("%d,", owner->info->argno))
     putchar('}');
     if (cur != NULL) print_extent(cur);
     putchar('!');
-    for (unsigned i= ei; i < n_elems(extents); ++i) {
+    for (size_t i= ei; i < n_elems(extents); ++i) {
         extent *e= get(extents, i);
         printf("%d: ", e->info->argno);
         print_extent(e);
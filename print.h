@@ -4,6 +4,14 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+#include "extents.h"
+#include "opts.h"
+#include "estimate.h"
+#include "frag.h"
+#include "sharing.h"
+#include "checksum.h"
+#include "cmp.h"
+
 // scanf/printf format for off_t
 #ifdef linux
 #define OFF_T "ld"
@@ -16,10 +24,28 @@
 extern void print_extents_by_file();
 extern void print_shared_extents();
 extern void print_shared_extents_no_header();
+extern void print_region(sh_ext *s_e);
 extern void print_self_shared_extents();
 extern void print_unshared_extents();
-extern void print_cmp(off_t start, off_t len);
+extern void print_cmp(off_t start, off_t len, region_kind kind);
+extern void print_pair_header(unsigned a, unsigned b);
+extern void print_pair_cmp(unsigned a, unsigned b, off_t start, off_t len, region_kind kind);
 extern char *flag_pr(unsigned flags, bool sharing);
 extern void print_file_key();
+extern void print_stability_report(bool all);
+extern void print_coalesce_report();
+extern void print_estimate_header(unsigned long samples, unsigned long holes, double secs);
+extern void print_estimate(unsigned n, unsigned long samples, estimate sh, estimate ex);
+extern void print_frag_header();
+extern void print_frag(unsigned rank, frag *f);
+extern void print_clusters_header();
+extern void print_cluster(unsigned n, unsigned *files, unsigned n_files, off_t total, off_t shared);
+extern void print_edges_header();
+extern void print_edge(unsigned a, unsigned b, off_t bytes);
+extern void print_checksums_header(off_t bytes_read, off_t total);
+extern void print_checksum(unsigned file, off_t size, digest *d);
+extern void print_phys_range_header(range *r);
+extern void print_phys_match(unsigned n, range *r, extent *e, off_t p, off_t len);
+extern void print_phys_no_match();
 
 #endif //EXTENTS_PRINT_H
@@ -0,0 +1,261 @@
+/*
+ * Batch queries over a loaded sharing map (--query)
+ *
+ * The files are mapped and find_shares() run once; each file then gets an index of the pieces (shared or unshared
+ * regions) it maps, in logical order, with running totals of its exclusive and shared bytes.  A query about a range
+ * of a file is two binary searches, plus a scan of the pieces in the range when they are to be listed.
+ *
+ * Queries are read one per line; files are numbered from 1, as in the rest of the output:
+ *   exclusive F [OFF [LEN]]  bytes of file F's range mapped by no other file (nor elsewhere in F)
+ *   shared F [OFF [LEN]]     bytes of file F's range which are shared
+ *   sharers F [OFF [LEN]]    each shared piece of the range, as "OFF LEN" followed by "G OFF" for each other file G
+ *                            (and offset) mapping it; terminated by an empty line
+ * OFF defaults to 0 and LEN to the rest of the file.  A bad query is answered by a line beginning "error:".
+ *
+ * The daemon (--daemon) patches the index as it replaces regions, rather than building it afresh: see
+ * update_query_index().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "extents.h"
+#include "lists.h"
+#include "mem.h"
+#include "print.h"
+#include "query.h"
+#include "sharing.h"
+
+typedef struct piece piece;
+struct piece {
+    off_t l, len; // logical extent within the file
+    sh_ext *sh;   // the region it maps
+};
+
+typedef struct file_index file_index;
+struct file_index {
+    unsigned n;
+    piece *pieces;     // in logical order (pieces never overlap)
+    off_t *excl_sum;   // excl_sum[i] is the # of exclusive bytes in pieces[0..i)
+    off_t *shared_sum; // similarly for shared bytes
+};
+
+static file_index *idx; // one per file
+
+static bool is_exclusive(piece *pc) { return n_owners(pc->sh) == 1; }
+
+static off_t piece_end(piece *pc) { return pc->l + pc->len; }
+
+static void add_piece(file_index *into, sh_ext *s, unsigned file, off_t l) {
+    file_index *fx= &into[file];
+    piece *pc= &fx->pieces[fx->n++];
+    pc->l= l;
+    pc->len= s->len;
+    pc->sh= s;
+}
+
+// add a piece for each owner of s to the index of its file in into
+static void add_pieces(file_index *into, sh_ext *s) {
+    for (unsigned r= 0; r < n_runs(s); ++r)
+        for (unsigned k= 0; k < run_count(s, r); ++k)
+            add_piece(into, s, run_file(s, r), run_l(s, r) + k * run_stride(s, r));
+}
+
+// add to count[f] the # of pieces the regions in l have in file f
+static void count_pieces(list *l, unsigned *count) {
+    ITER(l, sh_ext*, s, {
+        for (unsigned r= 0; r < n_runs(s); ++r)
+            count[run_file(s, r)] += run_count(s, r);
+    })
+}
+
+static int piece_cmp_log(const void *a, const void *b) {
+    off_t la= ((piece *) a)->l, lb= ((piece *) b)->l;
+    return la > lb ? 1 : la < lb ? -1 : 0;
+}
+
+// the running totals of fx's pieces, from piece from on
+static void sum_pieces(file_index *fx, unsigned from) {
+    fx->excl_sum[0]= fx->shared_sum[0]= 0;
+    for (unsigned j= from; j < fx->n; ++j) {
+        piece *pc= &fx->pieces[j];
+        bool excl= is_exclusive(pc);
+        fx->excl_sum[j + 1]= fx->excl_sum[j] + (excl ? pc->len : 0);
+        fx->shared_sum[j + 1]= fx->shared_sum[j] + (excl ? 0 : pc->len);
+    }
+}
+
+static void free_query_index() {
+    for (unsigned i= 0; i < nfiles; ++i) {
+        free(idx[i].pieces);
+        free(idx[i].excl_sum);
+        free(idx[i].shared_sum);
+    }
+    free(idx);
+}
+
+// (re)build the index from shared and the unsh lists
+void build_query_index() {
+    if (idx != NULL) free_query_index();
+    idx= calloc_s(nfiles, sizeof(file_index));
+    unsigned *count= calloc_s(nfiles, sizeof(unsigned));
+    for (unsigned i= 0; i < nfiles; ++i)
+        count[i]= n_elems(info[i].unsh);
+    count_pieces(shared, count);
+    for (unsigned i= 0; i < nfiles; ++i)
+        idx[i].pieces= calloc_s(count[i], sizeof(piece));
+    for (unsigned i= 0; i < nfiles; ++i)
+        ITER(info[i].unsh, sh_ext*, s, add_pieces(idx, s))
+    ITER(shared, sh_ext*, s, add_pieces(idx, s))
+    for (unsigned i= 0; i < nfiles; ++i) {
+        file_index *fx= &idx[i];
+        if (fx->n > 0) qsort(fx->pieces, fx->n, sizeof(piece), &piece_cmp_log);
+        fx->excl_sum= malloc_s((fx->n + 1) * sizeof(off_t));
+        fx->shared_sum= malloc_s((fx->n + 1) * sizeof(off_t));
+        sum_pieces(fx, 0);
+    }
+    free(count);
+}
+
+// index of the first piece ending after off
+static unsigned first_piece(file_index *fx, off_t off) {
+    unsigned lo= 0, hi= fx->n;
+    while (lo < hi) {
+        unsigned mid= lo + (hi - lo) / 2;
+        if (piece_end(&fx->pieces[mid]) > off) hi= mid;
+        else lo= mid + 1;
+    }
+    return lo;
+}
+
+// index of the first piece starting at or after end
+static unsigned after_pieces(file_index *fx, off_t end) {
+    unsigned lo= 0, hi= fx->n;
+    while (lo < hi) {
+        unsigned mid= lo + (hi - lo) / 2;
+        if (fx->pieces[mid].l >= end) hi= mid;
+        else lo= mid + 1;
+    }
+    return lo;
+}
+
+// Replace the pieces of fx from piece lo on, less the n_gone of them marked gone (sh NULL), merged with the pieces of
+// news (in logical order).
+static void splice_pieces(file_index *fx, unsigned lo, unsigned n_gone, file_index *news) {
+    unsigned n_tail= fx->n - lo, n= fx->n - n_gone + news->n;
+    piece *tail= calloc_s(n_tail, sizeof(piece));
+    for (unsigned i= 0; i < n_tail; ++i)
+        tail[i]= fx->pieces[lo + i];
+    fx->pieces= realloc_s(fx->pieces, max(n, 1) * sizeof(piece));
+    unsigned i= 0, j= 0, k= lo;
+    while (i < n_tail || j < news->n) {
+        if (i < n_tail && tail[i].sh == NULL) ++i;
+        else if (j == news->n || (i < n_tail && tail[i].l < news->pieces[j].l)) fx->pieces[k++]= tail[i++];
+        else fx->pieces[k++]= news->pieces[j++];
+    }
+    fx->n= n;
+    fx->excl_sum= realloc_s(fx->excl_sum, (n + 1) * sizeof(off_t));
+    fx->shared_sum= realloc_s(fx->shared_sum, (n + 1) * sizeof(off_t));
+    sum_pieces(fx, lo);
+    free(tail);
+}
+
+// The regions in gone (about to be freed) are replaced by those in added.  Apart from the file remapped, all of whose
+// pieces are among them, each file's pieces go and come over the same logical ranges, so only the part of its index
+// from the first piece to change is redone; the indices of the files without such pieces are untouched.
+void update_query_index(list *gone, list *added) {
+    unsigned *lo= malloc_s(nfiles * sizeof(unsigned)), *n_gone= calloc_s(nfiles, sizeof(unsigned));
+    for (unsigned f= 0; f < nfiles; ++f)
+        lo[f]= idx[f].n;
+    ITER(gone, sh_ext*, s, {
+        for (unsigned r= 0; r < n_runs(s); ++r)
+            for (unsigned k= 0; k < run_count(s, r); ++k) {
+                unsigned f= run_file(s, r);
+                unsigned i= first_piece(&idx[f], run_l(s, r) + k * run_stride(s, r));
+                idx[f].pieces[i].sh= NULL;
+                lo[f]= min(lo[f], i);
+                n_gone[f]++;
+            }
+    })
+    file_index *news= calloc_s(nfiles, sizeof(file_index));
+    unsigned *count= calloc_s(nfiles, sizeof(unsigned));
+    count_pieces(added, count);
+    for (unsigned f= 0; f < nfiles; ++f)
+        news[f].pieces= calloc_s(count[f], sizeof(piece));
+    ITER(added, sh_ext*, s, add_pieces(news, s))
+    for (unsigned f= 0; f < nfiles; ++f) {
+        file_index *nx= &news[f];
+        if (nx->n > 0) {
+            qsort(nx->pieces, nx->n, sizeof(piece), &piece_cmp_log);
+            lo[f]= min(lo[f], first_piece(&idx[f], nx->pieces[0].l));
+        }
+        if (n_gone[f] > 0 || nx->n > 0) splice_pieces(&idx[f], lo[f], n_gone[f], nx);
+        free(nx->pieces);
+    }
+    free(news);
+    free(count);
+    free(n_gone);
+    free(lo);
+}
+
+static off_t bytes_in(file_index *fx, off_t off, off_t end, bool exclusive) {
+    unsigned i= first_piece(fx, off), j= after_pieces(fx, end);
+    if (i >= j) return 0;
+    off_t *sum= exclusive ? fx->excl_sum : fx->shared_sum;
+    off_t total= sum[j] - sum[i];
+    piece *head= &fx->pieces[i], *tail= &fx->pieces[j - 1];
+    if (is_exclusive(head) == exclusive && head->l < off) total -= off - head->l;
+    if (is_exclusive(tail) == exclusive && piece_end(tail) > end) total -= piece_end(tail) - end;
+    return total;
+}
+
+static void list_sharers(file_index *fx, unsigned f, off_t off, off_t end, FILE *out) {
+    for (unsigned i= first_piece(fx, off); i < fx->n && fx->pieces[i].l < end; ++i) {
+        piece *pc= &fx->pieces[i];
+        if (is_exclusive(pc)) continue;
+        off_t from= max(off, pc->l), to= min(end, piece_end(pc));
+        fprintf(out, FIELD " " FIELD, from, to - from);
+        sh_ext *s= pc->sh;
+        for (unsigned r= 0; r < n_runs(s); ++r)
+            for (unsigned k= 0; k < run_count(s, r); ++k) {
+                off_t l= run_l(s, r) + k * run_stride(s, r);
+                if (run_file(s, r) != f || l != pc->l)
+                    fprintf(out, " %d " FIELD, run_file(s, r) + 1, l + (from - pc->l));
+            }
+        fputc('\n', out);
+    }
+    fputc('\n', out);
+}
+
+void answer_query(char *line, FILE *out) {
+    char cmd[16];
+    unsigned f;
+    off_t off= 0, len= -1;
+    int n= sscanf(line, "%15s %u " FIELD " " FIELD, cmd, &f, &off, &len);
+    if (n < 1) return; // blank line
+    if (n < 2 || f < 1 || f > nfiles || off < 0 || (n == 4 && len < 0)) {
+        fprintf(out, "error: bad query: %s", line);
+        if (strchr(line, '\n') == NULL) fputc('\n', out);
+        return;
+    }
+    file_index *fx= &idx[f - 1];
+    off_t end= len < 0 ? info[f - 1].size : off + len;
+    if (strcmp(cmd, "exclusive") == 0)
+        fprintf(out, FIELD "\n", bytes_in(fx, off, end, true));
+    else if (strcmp(cmd, "shared") == 0)
+        fprintf(out, FIELD "\n", bytes_in(fx, off, end, false));
+    else if (strcmp(cmd, "sharers") == 0)
+        list_sharers(fx, f - 1, off, end, out);
+    else
+        fprintf(out, "error: unknown query: %s\n", cmd);
+}
+
+void serve_queries(FILE *in, FILE *out) {
+    char *line= NULL;
+    size_t sz= 0;
+    while (getline(&line, &sz, in) >= 0) {
+        answer_query(line, out);
+        fflush(out);
+    }
+    free(line);
+}
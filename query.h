@@ -0,0 +1,15 @@
+// Answering queries about a loaded sharing map (--query)
+
+#ifndef EXTENTS_QUERY_H
+#define EXTENTS_QUERY_H
+
+#include <stdio.h>
+
+#include "lists.h"
+
+extern void build_query_index();
+extern void update_query_index(list *gone, list *added);
+extern void answer_query(char *line, FILE *out);
+extern void serve_queries(FILE *in, FILE *out);
+
+#endif //EXTENTS_QUERY_H
@@ -0,0 +1,248 @@
+/*
+ * Sharded analysis (--emit-shard, --merge)
+ *
+ * Mapping the extents of a great many files can be farmed out to several processes, or hosts: each maps a subset of
+ * the files with --emit-shard, which writes their extents, sorted by physical offset, to a shard on stdout.  --merge
+ * then reads the shards and merges their extents k ways, keeping the physical order, into the list of all extents,
+ * and the analysis goes on as if it had mapped all the files itself.
+ *
+ * Each file has a global ID, the ID of the first file of its shard (given to --emit-shard) plus its position in the
+ * shard, and --merge numbers the files in order of ID.  With IDs which are the files' positions in the whole list of
+ * files, the results are the same as those of a single run over all of them.
+ *
+ * A shard is, with all numbers unsigned LEB128 varints unless stated:
+ *   header:  "EXTSHARD", version (32 bits little-endian), device, block size, # files
+ *   files:   global ID, size, # extents, # of attempts to map it, whether it was stable (1 or 0), length of the name,
+ *            the name
+ *   extents: file (index in the shard), seq (index in the file's extents, in logical order), flags, logical offset,
+ *            physical offset less that of the extent before, length
+ * A file whose extents never settled (with -S) has none in the shard, and --merge leaves it out, as a single run would.
+ * (Version 1 shards had no attempts or stable flag.)
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extents.h"
+#include "fail.h"
+#include "lists.h"
+#include "mem.h"
+#include "opts.h"
+#include "print.h"
+#include "shard.h"
+#include "sorting.h"
+
+#define MAGIC "EXTSHARD"
+#define VERSION 2
+
+static void put_varint(uint64_t v) {
+    for (; v >= 0x80; v >>= 7)
+        putchar((int) ((v & 0x7f) | 0x80));
+    putchar((int) v);
+}
+
+void write_shard() {
+    phys_sort_extents();
+    fputs(MAGIC, stdout);
+    for (unsigned i= 0; i < 4; ++i)
+        putchar(VERSION >> 8 * i & 0xff);
+    put_varint((uint64_t) device);
+    put_varint((uint64_t) blk_sz);
+    put_varint(nfiles);
+    for (unsigned i= 0; i < nfiles; ++i) {
+        fileinfo *fi= &info[i];
+        size_t n= strlen(fi->name);
+        put_varint((uint64_t) shard_first + i);
+        put_varint((uint64_t) fi->size);
+        put_varint(fi->n_exts);
+        put_varint(fi->attempts);
+        put_varint(fi->stable);
+        put_varint(n);
+        fwrite(fi->name, 1, n, stdout);
+    }
+    off_t prev= 0;
+    ITER(extents, extent*, e, {
+        put_varint(e->info->argno);
+        put_varint(e->seq);
+        put_varint(e->flags);
+        put_varint((uint64_t) e->l);
+        put_varint((uint64_t) (e->p - prev));
+        put_varint((uint64_t) e->len);
+        prev= e->p;
+    })
+    if (fflush(stdout) != 0 || ferror(stdout)) fail("Can't write shard: %s\n", strerror(errno));
+}
+
+// a shard being merged
+typedef struct shard shard;
+struct shard {
+    char *name;
+    FILE *f;
+    unsigned version;
+    unsigned n_files;
+    fileinfo **files; // by index in the shard
+    size_t left;      // # of extents still to be read
+    off_t p;          // physical offset of the extent last read
+    extent *next;     // the extent last read, NULL once all are
+};
+
+static uint64_t get_varint(shard *s) {
+    uint64_t v= 0;
+    for (unsigned shift= 0; ; shift += 7) {
+        int c= getc(s->f);
+        if (c == EOF) fail("Shard %s is truncated\n", s->name);
+        if (shift > 63) fail("Shard %s is corrupt\n", s->name);
+        v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) return v;
+    }
+}
+
+// a file as a shard describes it, before the files of all the shards are numbered
+typedef struct shard_file shard_file;
+struct shard_file {
+    uint64_t id;
+    off_t size;
+    unsigned n_exts;
+    unsigned attempts;
+    bool stable;
+    char *name;
+    shard *s;
+    unsigned ix; // in s
+};
+
+static int shard_file_cmp(const void *pa, const void *pb) {
+    const shard_file *a= pa, *b= pb;
+    return a->id > b->id ? 1 : a->id < b->id ? -1 : 0;
+}
+
+// read the header of s, appending its files to fs (of which there are *n)
+static shard_file *read_header(shard *s, bool first, shard_file *fs, unsigned *n) {
+    char magic[sizeof(MAGIC) - 1];
+    unsigned char v[4];
+    if (fread(magic, 1, sizeof(magic), s->f) != sizeof(magic) || memcmp(magic, MAGIC, sizeof(magic)) != 0)
+        fail("%s is not a shard\n", s->name);
+    if (fread(v, 1, 4, s->f) != 4) fail("Shard %s is truncated\n", s->name);
+    s->version= v[0] | v[1] << 8 | v[2] << 16 | (uint32_t) v[3] << 24;
+    if (s->version < 1 || s->version > VERSION) fail("Shard %s is of an unknown version\n", s->name);
+    dev_t dev= (dev_t) get_varint(s);
+    blksize_t bs= (blksize_t) get_varint(s);
+    if (first) {
+        device= dev;
+        blk_sz= bs;
+    } else if (dev != device) fail("Error: All shards must be of the same filesystem!\n");
+    else if (bs != blk_sz) fail("block size weirdness! %d v %d\n", blk_sz, bs);
+    s->n_files= (unsigned) get_varint(s);
+    s->files= calloc_s(s->n_files, sizeof(fileinfo *));
+    fs= realloc_s(fs, (*n + s->n_files) * sizeof(shard_file));
+    s->left= 0;
+    for (unsigned i= 0; i < s->n_files; ++i) {
+        shard_file *sf= &fs[(*n)++];
+        sf->id= get_varint(s);
+        sf->size= (off_t) get_varint(s);
+        sf->n_exts= (unsigned) get_varint(s);
+        sf->attempts= s->version < 2 ? 1 : (unsigned) get_varint(s);
+        sf->stable= s->version < 2 || get_varint(s) != 0;
+        size_t len= get_varint(s);
+        sf->name= malloc_s(len + 1);
+        if (fread(sf->name, 1, len, s->f) != len) fail("Shard %s is truncated\n", s->name);
+        sf->name[len]= '\0';
+        sf->s= s;
+        sf->ix= i;
+        s->left += sf->n_exts;
+    }
+    return fs;
+}
+
+// read the next extent of s into its place in its file's extents
+static void advance(shard *s) {
+    if (s->left == 0) {
+        s->next= NULL;
+        return;
+    }
+    s->left--;
+    uint64_t file= get_varint(s), seq= get_varint(s);
+    if (file >= s->n_files || seq >= s->files[file]->n_exts) fail("Shard %s is corrupt\n", s->name);
+    extent *e= &s->files[file]->exts[seq];
+    e->info= s->files[file];
+    e->seq= (unsigned) seq;
+    e->flags= (unsigned) get_varint(s);
+    e->l= (off_t) get_varint(s);
+    s->p += (off_t) get_varint(s);
+    e->p= s->p;
+    e->len= (off_t) get_varint(s);
+    e->split= false;
+    s->next= e;
+}
+
+static bool shard_before(shard *a, shard *b) { return extent_list_cmp_phys(&a->next, &b->next) < 0; }
+
+// restore the heap property of h[0..n) below h[i]
+static void sift_down(shard **h, unsigned n, unsigned i) {
+    for (unsigned c; (c= 2 * i + 1) < n; i= c) {
+        if (c + 1 < n && shard_before(h[c + 1], h[c])) c++;
+        if (!shard_before(h[c], h[i])) break;
+        shard *t= h[i]; h[i]= h[c]; h[c]= t;
+    }
+}
+
+// read the nfiles shards fn, leaving the extents of all their files in extents, in physical order
+void read_shards(char *fn[]) {
+    unsigned n_shards= nfiles, n= 0;
+    shard *shards= calloc_s(n_shards, sizeof(shard));
+    shard_file *fs= NULL;
+    for (unsigned j= 0; j < n_shards; ++j) {
+        shard *s= &shards[j];
+        s->name= fn[j];
+        if ((s->f= fopen(s->name, "r")) == NULL) fail("Can't open shard %s : %s\n", s->name, strerror(errno));
+        fs= read_header(s, j == 0, fs, &n);
+    }
+    qsort(fs, n, sizeof(shard_file), &shard_file_cmp);
+    nfiles= n;
+    info= calloc_s(nfiles, sizeof(fileinfo));
+    for (unsigned i= 0; i < nfiles; ++i) {
+        shard_file *sf= &fs[i];
+        if (i > 0 && sf->id == fs[i - 1].id)
+            fail("Files %s and %s have the same ID (%lu)\n", fs[i - 1].name, sf->name, (unsigned long) sf->id);
+        fileinfo *fi= &info[i];
+        fi->name= sf->name;
+        fi->argno= i;
+        fi->size= sf->size;
+        fi->n_exts= sf->n_exts;
+        fi->exts= calloc_s(max(sf->n_exts, 1), sizeof(extent));
+        fi->unsh= new_list(-4);
+        fi->attempts= sf->attempts;
+        fi->stable= sf->stable;
+        sf->s->files[sf->ix]= fi;
+        n_ext += sf->n_exts;
+    }
+    free(fs);
+    print_stability_report(sync_extents); // files left out are reported even without -S, lest they seem empty
+
+    extents= new_list(-(ssize_t) max(n_ext, 1)); // exactly
+    shard **heap= calloc_s(n_shards, sizeof(shard *));
+    unsigned n_heap= 0;
+    for (unsigned j= 0; j < n_shards; ++j) {
+        advance(&shards[j]);
+        if (shards[j].next != NULL) heap[n_heap++]= &shards[j];
+    }
+    for (unsigned i= n_heap / 2; i-- > 0; )
+        sift_down(heap, n_heap, i);
+    while (n_heap > 0) {
+        shard *s= heap[0];
+        append(extents, s->next);
+        advance(s);
+        if (s->next == NULL) heap[0]= heap[--n_heap];
+        sift_down(heap, n_heap, 0);
+    }
+    for (unsigned j= 0; j < n_shards; ++j) {
+        if (getc(shards[j].f) != EOF) fail("Shard %s is corrupt\n", shards[j].name);
+        fclose(shards[j].f);
+        free(shards[j].files);
+    }
+    free(heap);
+    free(shards);
+}
@@ -0,0 +1,9 @@
+// Sharded analysis: shards of extents mapped separately, merged for analysis (--emit-shard, --merge)
+
+#ifndef EXTENTS_SHARD_H
+#define EXTENTS_SHARD_H
+
+extern void write_shard();
+extern void read_shards(char *fn[]);
+
+#endif //EXTENTS_SHARD_H
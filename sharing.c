@@ -10,9 +10,20 @@
  * (c) if the current sh_ext begins at the same offset as the next extent but is shorter, the next extent is split and
  *     the first part merged into the current sh_ext, or 
  * (d) the current sh_ext and next extent are the same, and the next is merged into the current.
+ *
+ * A finished sh_ext records its owners as an interned set of runs of (file, flags), shared with all other sh_exts
+ * having the same owners, plus the logical offsets of the runs as deltas from its physical offset and strides.  A run
+ * holds owners from one file whose offsets form an arithmetic progression, so a block cloned N times over its own file
+ * costs a single run.  It refers to no extent, so the pieces of split extents are recycled as soon as they are used up.
+ *
+ * With a region_sink (--stream), each finished sh_ext is passed on at once instead of being kept, so the results take
+ * no memory beyond the one being printed.
  */
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "extents.h"
@@ -21,33 +32,45 @@
 #include "sharing.h"
 #include "opts.h"
 #include "sorting.h"
+#include "owners.h"
+#include "fail.h"
 
-// components of the current shared extent being processed
-static off_t start, len, end;
-static list *owners; // list of extent*
-static extent *cur_e;
+// components of the current shared extent being processed (the state of a sweep is per thread, see below)
+static __thread off_t start, len, end;
+static __thread list *owners; // list of extent*
+static __thread extent *cur_e;
 
 list *shared;
 
-unsigned total_unshared= 0;
+void (*region_sink)(sh_ext *s)= NULL;
+
+size_t total_unshared= 0;
 
 static void append_owner(extent *e) { append(owners, e); }
 
 static void new_owner(extent *e) {
-    owners= new_list(-4);
+    if (owners == NULL) owners= new_list(-4);
+    owners->nelems= 0;
     append_owner(e);
 }
 
+// the extents being swept, in physical order (extended as extents are split)
+static __thread list *work;
+
 // next extent under consideration
-static unsigned ei;
-static extent *nxt_e; // == get(extents, ei), or NULL if at end
+static __thread size_t ei;
+static __thread extent *nxt_e; // == get(work, ei), or NULL if at end
+
+// where the sweep puts the regions it finds
+static __thread list *out_shared, **out_unsh;
+static __thread size_t out_n_unsh;
 
 static void next_extent() {
-    nxt_e= ++ei < n_elems(extents) ? get(extents, ei) : NULL;
+    nxt_e= ++ei < n_elems(work) ? get(work, ei) : NULL;
 }
 
 static void begin_next() {
-    cur_e= get(extents, ei);
+    cur_e= get(work, ei);
     new_owner(cur_e);
     start= cur_e->p;
     len= cur_e->len;
@@ -55,75 +78,173 @@ static void begin_next() {
     next_extent();
 }
 
+typedef struct placed placed;
+struct placed {
+    owner o;
+    off_t delta, stride;
+    unsigned seq;
+};
+
+static int placed_cmp(const void *a, const void *b) {
+    const placed *pa= a, *pb= b;
+    return pa->o.file > pb->o.file ? 1
+         : pa->o.file < pb->o.file ? -1
+         : pa->delta > pb->delta ? 1
+         : pa->delta < pb->delta ? -1
+         : 0;
+}
+
+static __thread placed *pl; // scratch, for sorting the owners
+static __thread owner *os;  // scratch, for the runs
+static __thread unsigned pl_sz= 0;
+
+static bool same_run(placed *a, placed *b) { return a->o.file == b->o.file && a->o.flags == b->o.flags; }
+
+// Group the n sorted owners in pl into runs, in place; returns the # of runs.
+static unsigned make_runs(unsigned n) {
+    unsigned n_runs= 0;
+    for (unsigned i= 0, j; i < n; i= j) {
+        off_t stride= i + 1 < n ? pl[i + 1].delta - pl[i].delta : 0;
+        for (j= i + 1; j < n && same_run(&pl[i], &pl[j]) && pl[j].delta - pl[j - 1].delta == stride; ++j)
+            ;
+        if (j - i < MIN_RUN) j= i + 1;
+        placed *r= &pl[n_runs++];
+        *r= pl[i];
+        r->o.count= j - i;
+        r->stride= stride;
+    }
+    return n_runs;
+}
+
+// the interned set of the current owners, leaving them in pl as its runs
+static ownerset *current_owners() {
+    unsigned n= n_elems(owners);
+    if (n > pl_sz) {
+        pl_sz= max(2 * pl_sz, n);
+        pl= realloc_s(pl, pl_sz * sizeof(placed));
+        os= realloc_s(os, pl_sz * sizeof(owner));
+    }
+    ITER(owners, extent*, e, {
+        placed *x= &pl[_i];
+        x->o.file= e->info->argno;
+        x->o.flags= e->flags;
+        x->delta= e->l - e->p;
+        x->seq= e->seq;
+    })
+    // the sweep mostly meets the owners in order already (see extent_list_cmp_phys)
+    for (unsigned i= 1; i < n; ++i)
+        if (placed_cmp(&pl[i - 1], &pl[i]) > 0) {
+            qsort(pl, n, sizeof(placed), &placed_cmp);
+            break;
+        }
+    n= make_runs(n);
+    for (unsigned i= 0; i < n; ++i)
+        os[i]= pl[i].o;
+    return intern_owners(os, n);
+}
+
 static sh_ext *new_sh_ext() {
-    sh_ext *res= malloc_s(sizeof(sh_ext));
+    ownerset *set= current_owners();
+    unsigned n= set->n;
+    sh_ext *res= malloc_s(sizeof(sh_ext) + (n + set->n_strided) * sizeof(off_t));
     res->p= start;
     res->len= len;
-    res->owners= owners;
-    res->self_shared= false;
+    res->owners= set;
+    res->seq= pl[0].seq;
+    for (unsigned i= 0; i < n; ++i) {
+        res->delta[i]= pl[i].delta;
+        if (set->o[i].count > 1) res->delta[n + set->o[i].stride_ix]= pl[i].stride;
+    }
     return res;
 }
 
 static void add_to_unshared(sh_ext *sh) {
-    if (is_singleton(sh->owners)) {
-        extent *owner= only(sh->owners);
-        append(owner->info->unsh, sh);
-        total_unshared++;
+    if (n_owners(sh) == 1) {
+        append(out_unsh[run_file(sh, 0)], sh);
+        out_n_unsh++;
     }
 }
 
+// pieces of split extents which have been used up, for reuse
+static __thread list *spare;
+
+// Owners whose extents start here are used up: their remainders, if any, were split off as new extents.  (An extent
+// which was instead trimmed to its remainder in place has moved on and is still in the work list.)
+static void recycle_used_up() {
+    ITER(owners, extent*, e, {
+        if (e->split && e->p == start)
+            append(spare, e);
+    })
+}
+
 static void process_current() {
     assert(!is_empty(owners));
-    sh_ext *s= new_sh_ext();
-    bool is_sing= is_singleton(owners);
-    if (is_sing || (cmp_output && skip1 != skip2))
-        add_to_unshared(s);
-    if (!is_sing)
-        append(shared, s);
-    if (ei < n_elems(extents)) begin_next();
+    if (clusters_mode) // only the bytes of each set of owners are wanted, not the regions
+        __atomic_fetch_add(&current_owners()->bytes, len, __ATOMIC_RELAXED);
+    else if (region_sink != NULL)
+        region_sink(new_sh_ext());
+    else {
+        sh_ext *s= new_sh_ext();
+        bool is_sing= is_singleton(owners);
+        if (is_sing || (cmp_output && skip1 != skip2))
+            add_to_unshared(s);
+        if (!is_sing)
+            append(out_shared, s);
+    }
+    recycle_used_up();
+    if (ei < n_elems(work)) begin_next();
 }
 
 static void swap_e(extent **a, extent **b) { extent *t= *a; *a= *b; *b= t; }
 
 // add a new extent to the list in the right place
 static void insert(extent *e) {
-    unsigned i, n= n_elems(extents);
-    for (i= ei; i < n && extent_list_cmp_phys(&e, (extent **) &GET(extents, i)) > 0; ++i)
+    size_t i, n= n_elems(work);
+    for (i= ei; i < n && extent_list_cmp_phys(&e, (extent **) &GET(work, i)) > 0; ++i)
         ;
-    if (i == n) append(extents, e);
+    if (i == n) append(work, e);
     else {
-        extent *lst= last(extents);
-        memmove(&GET(extents, i + 1), &GET(extents, i), (n - i - 1) * sizeof(extent *));
-        put(extents, i, e);
-        append(extents, lst);
+        extent *lst= last(work);
+        memmove(&GET(work, i + 1), &GET(work, i), (n - i - 1) * sizeof(extent *));
+        put(work, i, e);
+        append(work, lst);
     }
 }
 
 // the extent at ei has changed; move it to the right place to maintain sort order
 static void re_sort() {
     extent **a, **b;
-    for (unsigned i= ei;
-         i < n_elems(extents) - 1
-         && (a= (extent **) &GET(extents, i), b= (extent **) &GET(extents, i + 1), extent_list_cmp_phys(a, b) > 0);
+    for (size_t i= ei;
+         i < n_elems(work) - 1
+         && (a= (extent **) &GET(work, i), b= (extent **) &GET(work, i + 1), extent_list_cmp_phys(a, b) > 0);
          ++i)
         swap_e(a, b);
 }
 
-static extent *new_extent(fileinfo *pfi, off_t l, off_t p, off_t len, unsigned flags) {
-    extent *res= malloc_s(sizeof(extent));
+static extent *new_extent(fileinfo *pfi, off_t l, off_t p, off_t len, unsigned flags, unsigned seq) {
+    extent *res;
+    if (is_empty(spare))
+        res= malloc_s(sizeof(extent));
+    else {
+        res= last(spare);
+        spare->nelems--;
+    }
     res->info=    pfi;
     res->l=         l;
     res->p=         p;
     res->len=     len;
     res->flags= flags;
+    res->seq=     seq;
+    res->split=  true;
     return res;
 }
 
-void find_shares() {
-    check_all_extents_are_sane();
-    phys_sort_extents();
-    shared= new_list(-10); // SWAG
-    if (n_ext == 0) return;
+// Determine the sharing among exts (sorted by physical offset), appending the results to out_shared and out_unsh.
+// exts is used as the work list, so is reordered and extended with the pieces of split extents.
+static void sweep(list *exts) {
+    work= exts;
+    if (is_empty(work)) return;
+    if (spare == NULL) spare= new_list(-4);
     ei= 0;
     begin_next();
     while (nxt_e != NULL) {
@@ -133,8 +254,10 @@ void find_shares() {
                 len= start_nxt - start;
                 off_t tail_len= end - start_nxt;
                 // more efficient to insert all at once, since they all go at the same place. XXX
+                // (an owner trimmed in place has moved on, so its logical offset is found from its delta)
                 ITER(owners, extent*, owner, {
-                    extent *e= new_extent(owner->info, owner->l + len, start_nxt, tail_len, owner->flags);
+                    off_t l= owner->l - owner->p + start_nxt;
+                    extent *e= new_extent(owner->info, l, start_nxt, tail_len, owner->flags, owner->seq);
                     insert(e);
                 })
             }
@@ -148,38 +271,292 @@ void find_shares() {
                 nxt_e->p += len;
                 nxt_e->len= len_nxt;
                 re_sort();
-                nxt_e= get(extents, ei);
+                nxt_e= get(work, ei);
             } else  // same len
                 next_extent();
         }
     }
     process_current();
+    // by now every split piece has been used up, and is spare
+    size_t n= 0;
+    ITER(work, extent*, e, {
+        if (!e->split) put(work, n++, e);
+    })
+    work->nelems= n;
+    ITER(spare, extent*, e, free(e))
+    spare->nelems= 0;
 }
 
-extent *find_owner(sh_ext *s, unsigned i) {
-    ITER(s->owners, extent*, e, {
-        if (e->info->argno == i)
-            return e;
-    })
+// free the scratch space of this thread's sweeps
+static void free_scratch() {
+    free(pl);
+    free(os);
+    pl= NULL;
+    os= NULL;
+    pl_sz= 0;
+    if (owners != NULL) free_list(owners);
+    if (spare != NULL) free_list(spare);
+    owners= spare= NULL;
+}
+
+// sweep exts, appending the results to shared and the owners' unsh lists
+void sweep_extents(list *exts) {
+    list **unsh= calloc_s(nfiles, sizeof(list *));
+    for (unsigned i= 0; i < nfiles; ++i)
+        unsh[i]= info[i].unsh;
+    out_shared= shared;
+    out_unsh= unsh;
+    out_n_unsh= 0;
+    sweep(exts);
+    total_unshared += out_n_unsh;
+    free(unsh);
+}
+
+/*
+ * Sweeping in parallel
+ *
+ * Extents in disjoint physical ranges never interact, so the sorted extents are cut into ranges, each swept by a thread
+ * of its own, and the results are concatenated in order.  An extent which crosses a cut is split there, the part
+ * beyond going to the next range.  Cuts are made only where an extent starts: the sweep ends a region wherever an
+ * extent starts, so no region crosses a cut, and the results are exactly those of a single sweep.
+ */
+
+#define MIN_PER_THREAD 10000 // extents; fewer aren't worth a thread
+
+typedef struct partition partition;
+struct partition {
+    list *exts;      // the extents starting in the range (and the parts of those crossing into it)
+    list *shared;    // the results
+    list **unsh;
+    size_t n_unsh;
+    pthread_t thread;
+};
+
+static void *sweep_partition(void *arg) {
+    partition *pt= arg;
+    phys_sort(pt->exts);
+    out_shared= pt->shared;
+    out_unsh= pt->unsh;
+    out_n_unsh= 0;
+    sweep(pt->exts);
+    pt->n_unsh= out_n_unsh;
+    free_scratch();
     return NULL;
 }
 
-unsigned total_self_shared= 0, max_self_shared= 0;
+// the part of e from physical offset from to to, as a piece of a split extent
+static extent *piece(extent *e, off_t from, off_t to) {
+    extent *res= malloc_s(sizeof(extent));
+    *res= *e;
+    res->l= e->l + (from - e->p);
+    res->p= from;
+    res->len= to - from;
+    res->split= true;
+    return res;
+}
+
+static void find_shares_in_parallel(unsigned k) {
+    size_t n= n_elems(extents);
+    off_t cut[k + 1]; // partition j covers [cut[j], cut[j + 1])
+    unsigned np= 0;
+    for (unsigned j= 0; j < k; ++j) {
+        off_t c= ((extent *) get(extents, j * n / k))->p;
+        if (np == 0 || c > cut[np - 1]) cut[np++]= c;
+    }
+    cut[np]= INT64_MAX;
+    partition *parts= calloc_s(np, sizeof(partition));
+    for (unsigned j= 0; j < np; ++j) {
+        parts[j].exts= new_list(-(ssize_t) (n / np + 1));
+        parts[j].shared= new_list(-10);
+        parts[j].unsh= calloc_s(nfiles, sizeof(list *));
+        for (unsigned i= 0; i < nfiles; ++i)
+            parts[j].unsh[i]= new_list(-4);
+    }
+    unsigned j= 0;
+    ITER(extents, extent*, e, {
+        while (e->p >= cut[j + 1]) j++;
+        append(parts[j].exts, e);
+        off_t e_end= e->p + e->len;
+        for (unsigned q= j + 1; q < np && e_end > cut[q]; ++q)
+            append(parts[q].exts, piece(e, cut[q], min(e_end, cut[q + 1])));
+        if (e_end > cut[j + 1]) e->len= cut[j + 1] - e->p;
+    })
+    for (j= 0; j < np; ++j)
+        if (pthread_create(&parts[j].thread, NULL, &sweep_partition, &parts[j]) != 0)
+            fail("Can't create thread\n");
+    for (j= 0; j < np; ++j) {
+        partition *pt= &parts[j];
+        pthread_join(pt->thread, NULL);
+        splice(shared, n_elems(shared), n_elems(shared), pt->shared);
+        for (unsigned i= 0; i < nfiles; ++i) {
+            splice(info[i].unsh, n_elems(info[i].unsh), n_elems(info[i].unsh), pt->unsh[i]);
+            free_list(pt->unsh[i]);
+        }
+        total_unshared += pt->n_unsh;
+        free_list(pt->exts);
+        free_list(pt->shared);
+        free(pt->unsh);
+    }
+    free(parts);
+}
+
+/*
+ * Two files
+ *
+ * The commonest case, a clone checked against its base, needs none of the sweep's machinery unless a file shares
+ * blocks with itself.  Each file's extents, sorted by physical offset on their own, are then disjoint, and a merge of
+ * the two sequences cuts them straight into the regions: a region starts wherever the next extent of either file
+ * does, or the last region ended, and ends at the first extent end or start beyond.  Nothing is split, inserted or
+ * re-sorted, a region has at most one owner from each file, and its set of owners is one of a few, so is looked up
+ * only when the flags change.  The regions are exactly those of the sweep, in the same order.
+ */
+
+// the extents of file f in physical order, or NULL if any of them overlap
+static list *extents_of(unsigned f) {
+    list *res= new_list(-(ssize_t) max(info[f].n_exts, 1));
+    bool sorted= true;
+    ITER(extents, extent*, e, {
+        if (e->info->argno != f) continue;
+        if (e->len <= 0) {
+            free_list(res);
+            return NULL;
+        }
+        if (!is_empty(res) && ((extent *) last(res))->p > e->p) sorted= false;
+        append(res, e);
+    })
+    if (!sorted) phys_sort(res);
+    for (size_t i= 1; i < n_elems(res); ++i) {
+        extent *prev= get(res, i - 1);
+        if (prev->p + prev->len > ((extent *) get(res, i))->p) {
+            free_list(res);
+            return NULL;
+        }
+    }
+    return res;
+}
+
+// the set of the n owners own (in order of file), via sets, the last set found for each file and for both
+static ownerset *pair_owners(extent **own, unsigned n, ownerset **sets) {
+    ownerset **set= &sets[n == 2 ? 2 : own[0]->info->argno];
+    if (*set == NULL || (*set)->o[0].flags != own[0]->flags || (n == 2 && (*set)->o[1].flags != own[1]->flags)) {
+        owner os[2];
+        for (unsigned i= 0; i < n; ++i)
+            os[i]= (owner) { own[i]->info->argno, own[i]->flags, 1, 0 };
+        *set= intern_owners(os, n);
+    }
+    return *set;
+}
+
+// the region [p, p + len), mapped by e0 of the first file and e1 of the second, either of which may be NULL
+static void pair_region(off_t p, off_t len, extent *e0, extent *e1, ownerset **sets) {
+    extent *own[2];
+    unsigned n= 0;
+    if (e0 != NULL) own[n++]= e0;
+    if (e1 != NULL) own[n++]= e1;
+    ownerset *set= pair_owners(own, n, sets);
+    if (clusters_mode) {
+        set->bytes += len;
+        return;
+    }
+    sh_ext *s= malloc_s(sizeof(sh_ext) + n * sizeof(off_t));
+    s->p= p;
+    s->len= len;
+    s->owners= set;
+    s->seq= own[0]->seq;
+    for (unsigned i= 0; i < n; ++i)
+        s->delta[i]= own[i]->l - own[i]->p;
+    if (region_sink != NULL)
+        region_sink(s);
+    else if (n == 1) {
+        append(info[own[0]->info->argno].unsh, s);
+        total_unshared++;
+    } else
+        append(shared, s);
+}
+
+// find the shares between two files by merging their extents; false (having done nothing) if a file overlaps itself
+static bool find_shares_of_two() {
+    list *exts[2]= { extents_of(0), NULL };
+    if (exts[0] == NULL || (exts[1]= extents_of(1)) == NULL) {
+        if (exts[0] != NULL) free_list(exts[0]);
+        return false;
+    }
+    ownerset *sets[3]= { NULL, NULL, NULL };
+    size_t i[2]= { 0, 0 };
+    extent *e[2];
+    off_t from[2]; // where the rest of e[k] begins
+    for (unsigned k= 0; k < 2; ++k) {
+        e[k]= is_empty(exts[k]) ? NULL : get(exts[k], 0);
+        if (e[k] != NULL) from[k]= e[k]->p;
+    }
+    while (e[0] != NULL || e[1] != NULL) {
+        off_t p= e[1] == NULL || (e[0] != NULL && from[0] <= from[1]) ? from[0] : from[1], end= INT64_MAX;
+        bool in[2];
+        for (unsigned k= 0; k < 2; ++k) {
+            in[k]= e[k] != NULL && from[k] == p;
+            if (in[k]) end= min(end, e[k]->p + e[k]->len);
+            else if (e[k] != NULL) end= min(end, from[k]);
+        }
+        pair_region(p, end - p, in[0] ? e[0] : NULL, in[1] ? e[1] : NULL, sets);
+        for (unsigned k= 0; k < 2; ++k)
+            if (in[k] && (from[k]= end) == e[k]->p + e[k]->len) {
+                e[k]= ++i[k] < n_elems(exts[k]) ? get(exts[k], i[k]) : NULL;
+                if (e[k] != NULL) from[k]= e[k]->p;
+            }
+    }
+    free_list(exts[0]);
+    free_list(exts[1]);
+    return true;
+}
+
+void find_shares() {
+    check_all_extents_are_sane();
+    shared= new_list(-10); // SWAG
+    if (nfiles == 2 && find_shares_of_two()) return;
+    phys_sort_extents();
+    unsigned k= min(threads, n_elems(extents) / MIN_PER_THREAD);
+    if (k > 1 && region_sink == NULL) // a sink gets the regions in order, from a single sweep
+        find_shares_in_parallel(k);
+    else sweep_extents(extents);
+}
+
+unsigned n_owners(sh_ext *s) { return s->owners->n_owners; }
+
+unsigned n_runs(sh_ext *s) { return s->owners->n; }
+
+unsigned run_file(sh_ext *s, unsigned r) { return s->owners->o[r].file; }
+
+unsigned run_flags(sh_ext *s, unsigned r) { return s->owners->o[r].flags; }
+
+unsigned run_count(sh_ext *s, unsigned r) { return s->owners->o[r].count; }
+
+// logical offset at which the first owner of the run maps s
+off_t run_l(sh_ext *s, unsigned r) { return s->p + s->delta[r]; }
+
+off_t run_stride(sh_ext *s, unsigned r) {
+    owner *o= &s->owners->o[r];
+    return o->count > 1 ? s->delta[n_runs(s) + o->stride_ix] : 0;
+}
+
+// index of the first run from file, or -1
+int find_run(sh_ext *s, unsigned file) {
+    unsigned lo= 0, hi= n_runs(s);
+    while (lo < hi) {
+        unsigned mid= lo + (hi - lo) / 2;
+        if (run_file(s, mid) >= file) hi= mid;
+        else lo= mid + 1;
+    }
+    return lo < n_runs(s) && run_file(s, lo) == file ? (int) lo : -1;
+}
+
+size_t total_self_shared= 0;
+unsigned max_self_shared= 0;
 
-// relies on owners being sorted
 void find_self_shares() {
     ITER(shared, sh_ext*, s_e, {
-        extent *last= NULL;
-        ITER(s_e->owners, extent * , o, {
-            if (last != NULL && o->info == last->info) {
-                s_e->self_shared= true;
-                total_self_shared++;
-                unsigned n= n_elems(s_e->owners);
-                if (n > max_self_shared) max_self_shared= n;
-                goto out;
-            }
-            last= o;
-        })
-        out:;
+        if (s_e->owners->self_shared) {
+            total_self_shared++;
+            max_self_shared= max(max_self_shared, n_runs(s_e));
+        }
     })
 }
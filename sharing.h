@@ -5,21 +5,38 @@
 #ifndef EXTENTS_SHARING_H
 #define EXTENTS_SHARING_H
 
+#include "owners.h"
+
 // an extent with its sharing info
 typedef struct sh_ext sh_ext;
 struct sh_ext {
     off_t p;          // physical offset on device
     off_t len;
-    list *owners;     // the original extent*s from whence it came
-    bool self_shared; // mapped to two or more logical extents in the same file
+    ownerset *owners; // the files which map it (self-shared if owners->self_shared)
+    unsigned seq;     // seq of the extent of the first owner of the first run
+    off_t delta[];    // the first owner of the ith run maps it at logical offset p + delta[i]; the strides of the
+                      // strided runs follow
 };
 
 extern list *shared; // list of sh_ext*
 
-extern unsigned total_unshared, total_self_shared, max_self_shared;
+// If set, find_shares() passes each region to it as soon as the region is finished, in physical order, instead of
+// keeping it in shared or an unsh list; the sink must free it.
+extern void (*region_sink)(sh_ext *s);
+
+extern size_t total_unshared, total_self_shared;
+extern unsigned max_self_shared;
 
 extern void find_shares();
-extern extent *find_owner(sh_ext *s, unsigned i);
+extern void sweep_extents(list *exts);
+extern unsigned n_owners(sh_ext *s);
+extern unsigned n_runs(sh_ext *s);
+extern unsigned run_file(sh_ext *s, unsigned r);
+extern unsigned run_flags(sh_ext *s, unsigned r);
+extern unsigned run_count(sh_ext *s, unsigned r);
+extern off_t run_l(sh_ext *s, unsigned r);
+extern off_t run_stride(sh_ext *s, unsigned r);
+extern int find_run(sh_ext *s, unsigned file);
 extern void find_self_shares();
 
 #endif //EXTENTS_SHARING_H
@@ -1,23 +1,108 @@
 
+#include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "sorting.h"
+#include "mem.h"
 
 #ifndef linux
 typedef int (* _Nonnull __compar_fn_t)(const void *, const void *);
 #endif
 
-static int sh_ext_list_cmp_log(sh_ext **a, sh_ext **b) {
-    extent *fa= first((*a)->owners), *fb= first((*b)->owners);
-    return fa->l > fb->l ? 1
-         : fa->l < fb->l ? -1
-         : 0;
+/*
+ * Logical order
+ *
+ * find_shares() produces regions in physical order.  The regions whose first owner's extent is the same are then in
+ * logical order already, as that extent maps them in order; so a stable bucket sort on the seq of that extent puts the
+ * regions whose first owner is a file in logical order, in linear time.  The files' sequences are then merged.  Ties
+ * in logical offset (among files) are broken by physical offset, as a stable sort would.
+ */
+
+// stably bucket sort the n regions a, whose first owner is file f, by seq, via the scratch space tmp
+static void seq_sort(sh_ext **a, size_t n, unsigned f, sh_ext **tmp) {
+    if (n < 2) return;
+    unsigned n_b= info[f].n_exts;
+    size_t *at= calloc_s(n_b + 1, sizeof(size_t));
+    for (size_t i= 0; i < n; ++i) {
+        assert(a[i]->seq < n_b);
+        at[a[i]->seq + 1]++;
+    }
+    for (unsigned b= 0; b < n_b; ++b)
+        at[b + 1] += at[b];
+    for (size_t i= 0; i < n; ++i)
+        tmp[at[a[i]->seq]++]= a[i];
+    memcpy(a, tmp, n * sizeof(sh_ext *));
+    free(at);
+}
+
+static bool log_before(sh_ext *a, sh_ext *b) {
+    off_t la= run_l(a, 0), lb= run_l(b, 0);
+    return la < lb || (la == lb && a->p < b->p);
 }
 
+// a file's sequence of regions, being merged
+typedef struct seq_head seq_head;
+struct seq_head {
+    sh_ext **next, **end;
+};
+
+static bool head_before(seq_head *a, seq_head *b) { return log_before(*a->next, *b->next); }
+
+// restore the heap property of h[0..n) below h[i]
+static void sift_down(seq_head *h, unsigned n, unsigned i) {
+    for (unsigned c; (c= 2 * i + 1) < n; i= c) {
+        if (c + 1 < n && head_before(&h[c + 1], &h[c])) c++;
+        if (!head_before(&h[c], &h[i])) break;
+        seq_head t= h[i]; h[i]= h[c]; h[c]= t;
+    }
+}
+
+// put l, a list of regions in physical order, into logical order of their first owners
 void log_sort(list *l) {
-    qsort(l->elems, l->nelems, sizeof(void *), (__compar_fn_t) &sh_ext_list_cmp_log);
+    size_t n= n_elems(l);
+    if (n < 2) return;
+    sh_ext **a= (sh_ext **) l->elems, **tmp= malloc_s(n * sizeof(sh_ext *));
+    unsigned f0= run_file(a[0], 0);
+    bool one_file= true;
+    for (size_t i= 1; i < n && one_file; ++i)
+        one_file= run_file(a[i], 0) == f0;
+    if (one_file) {
+        seq_sort(a, n, f0, tmp);
+        free(tmp);
+        return;
+    }
+
+    // bucket by file, then each file's regions by seq
+    size_t *at= calloc_s(nfiles + 1, sizeof(size_t));
+    for (size_t i= 0; i < n; ++i)
+        at[run_file(a[i], 0) + 1]++;
+    for (unsigned f= 0; f < nfiles; ++f)
+        at[f + 1] += at[f];
+    for (size_t i= 0; i < n; ++i)
+        tmp[at[run_file(a[i], 0)]++]= a[i];
+    // at[f] is now the end of file f's regions in tmp
+    seq_head *h= malloc_s(nfiles * sizeof(seq_head));
+    unsigned n_h= 0;
+    size_t from= 0;
+    for (unsigned f= 0; f < nfiles; from= at[f++]) {
+        if (at[f] == from) continue;
+        seq_sort(&tmp[from], at[f] - from, f, a);
+        h[n_h++]= (seq_head) { &tmp[from], &tmp[at[f]] };
+    }
+    for (unsigned i= n_h / 2; i-- > 0; )
+        sift_down(h, n_h, i);
+    for (size_t i= 0; n_h > 0; ++i) {
+        a[i]= *h[0].next++;
+        if (h[0].next == h[0].end) h[0]= h[--n_h];
+        sift_down(h, n_h, 0);
+    }
+    free(h);
+    free(at);
+    free(tmp);
 }
 
+// by physical offset, then length, then as the owners of a region are ordered
 int extent_list_cmp_phys(extent **pa, extent **pb)
 {
     extent *a= *pa, *b= *pb;
@@ -25,19 +110,22 @@ int extent_list_cmp_phys(extent **pa, extent **pb)
          : a->p < b->p ? -1
          : a->len > b->len ? 1
          : a->len < b->len ? -1
+         : a->info->argno > b->info->argno ? 1
+         : a->info->argno < b->info->argno ? -1
+         : a->l > b->l ? 1
+         : a->l < b->l ? -1
          : 0;
 }
 
-void phys_sort_extents() {
-    qsort(&GET(extents, 0), n_ext, sizeof(extent *), (__compar_fn_t) &extent_list_cmp_phys);
+void phys_sort(list *l) {
+    qsort(l->elems, l->nelems, sizeof(extent *), (__compar_fn_t) &extent_list_cmp_phys);
 }
 
-static int extent_list_cmp_fileno(extent **a, extent **b) {
-    return (*a)->info->argno > (*b)->info->argno ?  1
-         : (*a)->info->argno < (*b)->info->argno ? -1
-         : 0;
+// (they may be in order already, as --merge leaves them)
+void phys_sort_extents() {
+    size_t i= 1;
+    while (i < n_ext && extent_list_cmp_phys((extent **) &GET(extents, i - 1), (extent **) &GET(extents, i)) <= 0)
+        i++;
+    if (i < n_ext) qsort(&GET(extents, 0), n_ext, sizeof(extent *), (__compar_fn_t) &extent_list_cmp_phys);
 }
 
-void fileno_sort(list *ps) {
-    qsort(ps->elems, ps->nelems, sizeof(void *), (__compar_fn_t) &extent_list_cmp_fileno);
-}
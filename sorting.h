@@ -6,12 +6,12 @@
 #include "extents.h"
 #include "sharing.h"
 
-extern void log_sort(list *l);
+extern void log_sort(list *l); // l must be in physical order, as find_shares() leaves it
 
 int extent_list_cmp_phys(extent **pa, extent **pb);
 
-extern void phys_sort_extents();
+extern void phys_sort(list *l);
 
-void fileno_sort(list *ps);
+extern void phys_sort_extents();
 
 #endif //EXTENTS_SORTING_H